@@ -1,6 +1,61 @@
 
+#include <inc/x86.h>
+
 #include "fs.h"
 
+// Dirty-block list.  Cached blocks are mapped read-only until the
+// first write to them faults; bc_pgfault then maps the page writable
+// and appends the block here.  So a block is dirty exactly when its
+// page is writable, and syncing only has to visit the blocks on this
+// list.  flush_block does not remove entries: stale ones (flushed,
+// evicted) are skipped by the next sync or compaction.
+#define BC_DIRTY_MAX	512
+
+static uint32_t bc_dirty[BC_DIRTY_MAX] FS_SHARED;
+static int bc_ndirty FS_SHARED;
+
+// The server's worker envs all map the cache, so the dirty list, and
+// the page mappings in the DISKMAP region, change only under bc_lock.
+// Disk reads happen outside it: a block read in is staged in private
+// pages at BCSTAGE and mapped into the cache only once complete, so a
+// worker that faults on a cached block never waits behind another
+// worker's cache miss.  Writes are done under the lock, so that a
+// block cannot be dirtied again in between.
+static struct mutex bc_lock FS_SHARED;
+#define BCSTAGE		((char *) (DISKMAP - PTSIZE))
+
+// Deferred write-back: dirty blocks are written out (fs_writeback)
+// once the oldest has waited BC_WB_DELAY_MS or the list holds
+// BC_WB_HIGH entries, whichever comes first.
+#define BC_WB_DELAY_MS	1000
+#define BC_WB_HIGH	(BC_DIRTY_MAX / 2)
+
+static struct timespec bc_dirty_since FS_SHARED;	// When the list became non-empty
+
+// Replacement.  The cache holds at most bc_limit blocks, besides the
+// super block and the bitmap, which stay mapped for good (they are read
+// with bc_lock held, so faulting them back in would deadlock).  The
+// cached blocks are listed in bc_frames, and the CLOCK hand sweeps over
+// them: a block whose page the hardware has marked accessed since the
+// hand last passed gets its PTE_A cleared and a second chance, and the
+// first one not accessed is evicted.  Evicting a dirty block writes
+// out the whole dirty list first, in one elevator pass.  Code holding
+// a pointer into an evicted block just faults it back in.
+static uint32_t bc_frames[BC_NBLOCKS] FS_SHARED;
+static int bc_nframes FS_SHARED;
+static int bc_hand FS_SHARED;
+static int bc_limit FS_SHARED;
+
+static struct Fscachestat bc_stats FS_SHARED;
+
+// Blocks held back by the metadata log (log.c): the running
+// transaction has changed them, so they must not reach their place on
+// disk before it commits.  Write-back and eviction pass them over.
+// Holding a block takes bc_lock, so it cannot slip in while the block
+// is on its way to disk.
+static uint32_t bc_held[LOG_MAX] FS_SHARED;
+static int bc_nheld FS_SHARED;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,6 +79,177 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Is this cached block on the dirty list, i.e. mapped writable?
+static bool
+va_is_writable(void *va)
+{
+	return va_is_mapped(va) && (uvpt[PGNUM(va)] & PTE_W);
+}
+
+// Is blockno held back by the log?  Called with bc_lock held.
+static bool
+bc_is_held(uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < bc_nheld; i++)
+		if (bc_held[i] == blockno)
+			return 1;
+	return 0;
+}
+
+// Hold back the block containing addr until bc_release.  Returns 0 on
+// success, -E_NO_MEM if LOG_MAX blocks are held already.
+int
+bc_hold(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int r = 0;
+
+	mutex_lock(&bc_lock);
+	if (!bc_is_held(blockno)) {
+		if (bc_nheld < LOG_MAX)
+			bc_held[bc_nheld++] = blockno;
+		else
+			r = -E_NO_MEM;
+	}
+	mutex_unlock(&bc_lock);
+	return r;
+}
+
+// Copy the held block numbers into blocks, which has room for LOG_MAX,
+// and return how many there are.
+int
+bc_held_blocks(uint32_t *blocks)
+{
+	int n;
+
+	mutex_lock(&bc_lock);
+	n = bc_nheld;
+	memmove(blocks, bc_held, n * sizeof(uint32_t));
+	mutex_unlock(&bc_lock);
+	return n;
+}
+
+// Let the held blocks be written back again.
+void
+bc_release(void)
+{
+	mutex_lock(&bc_lock);
+	bc_nheld = 0;
+	mutex_unlock(&bc_lock);
+}
+
+// Do the super block and bitmap blocks hold blockno?  Those are never
+// evicted.  Until the super block is read, everything is.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return !super
+		|| blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Is the block cached?  Counts a hit or a miss, for the file
+// operations that look up blocks they are about to use.
+bool
+bc_lookup(uint32_t blockno)
+{
+	if (va_is_mapped(diskaddr(blockno))) {
+		xadd(&bc_stats.cs_hits, 1);
+		return 1;
+	}
+	xadd(&bc_stats.cs_misses, 1);
+	return 0;
+}
+
+static void bc_sync_locked(void);
+
+// Evict one block, chosen by the CLOCK hand, and give its slot to
+// blockno, moving the hand past it: a block just brought in has not
+// been accessed yet, and must not be the next one evicted.  With
+// blockno 0 the slot is given up.  Called with bc_lock held and
+// bc_nframes > 0.
+static void
+bc_evict(uint32_t blockno)
+{
+	void *va;
+	pte_t pte;
+	int r;
+
+	while (1) {
+		if (bc_hand >= bc_nframes)
+			bc_hand = 0;
+		va = diskaddr(bc_frames[bc_hand]);
+		pte = uvpt[PGNUM(va)];
+		if (bc_is_held(bc_frames[bc_hand])) {
+			bc_hand++;
+			continue;
+		}
+		if (!(pte & PTE_A))
+			break;
+		// Mapping the page again clears PTE_A
+		if ((r = sys_page_map(0, va, 0, va, pte & PTE_SYSCALL)) < 0)
+			panic("bc_evict: sys_page_map: %i", r);
+		bc_hand++;
+	}
+
+	if (pte & PTE_W) {
+		bc_sync_locked();
+		bc_stats.cs_dirty_evictions++;
+	}
+	if ((r = sys_page_unmap(0, va)) < 0)
+		panic("bc_evict: sys_page_unmap: %i", r);
+	if (blockno)
+		bc_frames[bc_hand++] = blockno;
+	else
+		bc_frames[bc_hand] = bc_frames[--bc_nframes];
+	bc_stats.cs_evictions++;
+}
+
+// Give blockno a slot in bc_frames, evicting a block if the cache is
+// full.  Called with bc_lock held.
+static void
+bc_add_frame(uint32_t blockno)
+{
+	if (bc_nframes >= bc_limit)
+		bc_evict(blockno);
+	else
+		bc_frames[bc_nframes++] = blockno;
+}
+
+// Drop entries for blocks that are no longer dirty.
+static void
+bc_compact(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < bc_ndirty; i++)
+		if (va_is_writable(diskaddr(bc_dirty[i])))
+			bc_dirty[n++] = bc_dirty[i];
+	bc_ndirty = n;
+}
+
+// Let the cached block at addr be written and remember it as dirty.
+// Called with bc_lock held.
+static void
+bc_mark_dirty(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int r;
+
+	if (bc_ndirty == BC_DIRTY_MAX)
+		bc_compact();
+	if (bc_ndirty == BC_DIRTY_MAX)
+		bc_sync_locked();
+	if (bc_ndirty == 0)
+		vsys_clock_gettime(CLOCK_MONOTONIC, &bc_dirty_since);
+	bc_dirty[bc_ndirty++] = blockno;
+
+	if ((r = sys_page_map(0, addr, 0, addr,
+			      (uvpt[PGNUM(addr)] & PTE_SYSCALL) | PTE_W)) < 0)
+		panic("bc_mark_dirty: sys_page_map: %i", r);
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -42,41 +268,131 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
-	// Allocate a page in the disk map region, read the contents
-	// of the block from the disk into that page.
-	// Hint: first round addr to page boundary. fs/ide.c has code to read
-	// the disk.
-	//
-	// LAB 10: you code here:
+	// Read just this block.  file_read decides when its neighbours
+	// are worth reading ahead, since it knows which file they hold.
+	// Another worker may have read it in, or dirtied it, since the
+	// fault; then there is nothing left to do.
 	addr = ROUNDDOWN(addr, BLKSIZE);
-	r = sys_page_alloc(0, addr, PTE_P | PTE_U | PTE_W);
-	if (r < 0){
-		panic("bc_pgfault: sys_page_alloc error %i at addr %08x\n", r, (uint32_t)addr);
+	if (!va_is_mapped(addr) && (r = bc_read_cluster(blockno, 1)) < 0)
+		panic("bc_pgfault: bc_read_cluster: %i", r);
+
+	// First write to a clean block.  If the block has been evicted
+	// again in the meantime, the write just faults once more.
+	if (utf->utf_err & FEC_WR) {
+		mutex_lock(&bc_lock);
+		if (va_is_mapped(addr) && !va_is_writable(addr))
+			bc_mark_dirty(addr);
+		mutex_unlock(&bc_lock);
 	}
+}
+
+// Read blocks [blockno, blockno + n) into the block cache with a
+// single disk command, so that a run of contiguous blocks costs one
+// transfer instead of one page fault and one transfer per block.
+// The run stops early at the first block that is already cached.
+// Returns the number of blocks read, < 0 on error.
+int
+bc_read_cluster(uint32_t blockno, int n)
+{
+	void *addr = diskaddr(blockno), *va;
+	char *stage;
+	int i, r;
+
+	n = MIN(n, BC_CLUSTER_MAX);
+	if (super)
+		n = MIN(n, super->s_nblocks - blockno);
+	for (i = 0; i < n; i++)
+		if (va_is_mapped(addr + i * BLKSIZE))
+			break;
+	if ((n = i) == 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, BCSTAGE + i * BLKSIZE, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("bc_read_cluster: sys_page_alloc error %i at addr %08x\n",
+			      r, (uint32_t) BCSTAGE + i * BLKSIZE);
+
+	if (ide_read(blockno * BLKSECTS, BCSTAGE, n * BLKSECTS) < 0)
+		panic("bc_read_cluster: ide_read failed\n");
 
-	if (ide_read(blockno * BLKSECTS, addr, BLKSECTS) < 0){
-		panic("bc_pgfault: ide_read failed\n");
+	mutex_lock(&bc_lock);
+	for (i = 0; i < n; i++) {
+		va = addr + i * BLKSIZE;
+		stage = BCSTAGE + i * BLKSIZE;
+
+		// Map the page read-only and with the dirty bit clear, since
+		// we just read the block from disk, making room for it first.
+		// If another worker got there first, keep its copy: it may
+		// be dirty by now.
+		if (!va_is_mapped(va)) {
+			if (!bc_pinned(blockno + i))
+				bc_add_frame(blockno + i);
+			if ((r = sys_page_map(0, stage, 0, va, PTE_P | PTE_U)) < 0)
+				panic("in bc_read_cluster, sys_page_map: %i", r);
+			bc_stats.cs_reads++;
+		}
+		sys_page_unmap(0, stage);
+
+		// Check that the block we read was allocated. (exercise for
+		// the reader: why do we do this *after* reading the block
+		// in?)
+		if (bitmap && block_is_free(blockno + i))
+			panic("reading free block %08x\n", blockno + i);
+	}
+	mutex_unlock(&bc_lock);
+	return n;
+}
+
+// Cache blockno, which has just been allocated, as a zeroed dirty
+// block without reading it: what is on disk there is garbage.  So
+// appending to a file, with fs_lock held for writing, does not wait
+// for the disk.
+void
+bc_fresh(uint32_t blockno)
+{
+	void *va = diskaddr(blockno);
+	int r;
+
+	mutex_lock(&bc_lock);
+	if (!va_is_mapped(va)) {
+		if (!bc_pinned(blockno))
+			bc_add_frame(blockno);
+		if ((r = sys_page_alloc(0, va, PTE_P | PTE_U)) < 0)
+			panic("bc_fresh: sys_page_alloc: %i", r);
+		bc_mark_dirty(va);
 	}
+	mutex_unlock(&bc_lock);
+}
+
+// Write the n cached, writable blocks starting at blockno with one
+// disk command and map them read-only again.  Their pages are
+// consecutive in the DISKMAP region, so the run is one buffer.
+// The pages go read-only first: a worker that writes to a block while
+// it is on its way to disk faults and puts it back on the dirty list.
+// Called with bc_lock held.
+static void
+bc_write_cluster(uint32_t blockno, int n)
+{
+	void *addr = diskaddr(blockno), *va;
+	int i, r;
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
-		panic("in bc_pgfault, sys_page_map: %i", r);
+	for (i = 0; i < n; i++) {
+		va = addr + i * BLKSIZE;
+		if ((r = sys_page_map(0, va, 0, va,
+				      uvpt[PGNUM(va)] & PTE_SYSCALL & ~PTE_W)) < 0)
+			panic("bc_write_cluster: sys_page_map error %i at addr %08x\n",
+			      r, (uint32_t) va);
+	}
 
-	// Check that the block we read was allocated. (exercise for
-	// the reader: why do we do this *after* reading the block
-	// in?)
-	if (bitmap && block_is_free(blockno))
-		panic("reading free block %08x\n", blockno);
+	if (ide_write(blockno * BLKSECTS, addr, n * BLKSECTS) < 0)
+		panic("ide_write failed\n");
 }
 
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
-// nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
+// nothing.  Afterwards the page is read-only again, so the next write
+// puts it back on the dirty list.
 void
 flush_block(void *addr)
 {
@@ -87,15 +403,111 @@ flush_block(void *addr)
 
 	// LAB 10: Your code here.
 	addr = ROUNDDOWN(addr, BLKSIZE);
-	if (va_is_mapped(addr) && va_is_dirty(addr)) {
-		if (ide_write(blockno * BLKSECTS, addr, BLKSECTS) < 0){
-			panic("ide_write failed\n");
-		}
-		int r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL);
-		if (r < 0){
-			panic("flush_block: sys_page_map error %i at addr %08x\n", r, (uint32_t)addr);
+	mutex_lock(&bc_lock);
+	if (va_is_writable(addr) && !bc_is_held(blockno))
+		bc_write_cluster(blockno, 1);
+	mutex_unlock(&bc_lock);
+}
+
+// Number of entries on the dirty list, an upper bound on the number
+// of dirty blocks.
+int
+bc_dirty_count(void)
+{
+	return bc_ndirty;
+}
+
+// Write every dirty block to disk, except those held back by the log,
+// which stay on the dirty list.  Costs one step per dirty-list entry,
+// however large the disk is.  The blocks go out in one
+// ascending sweep (an elevator pass), and every run of consecutive
+// block numbers becomes a single transfer of up to BC_CLUSTER_MAX
+// blocks.
+void
+bc_sync(void)
+{
+	mutex_lock(&bc_lock);
+	bc_sync_locked();
+	mutex_unlock(&bc_lock);
+}
+
+// bc_sync, with bc_lock held.
+static void
+bc_sync_locked(void)
+{
+	uint32_t b;
+	int i, j, n = 0;
+
+	// Sort the entries still dirty into bc_dirty[0..n).  Insertion
+	// sort: the list is short and mostly in order already.
+	for (i = 0; i < bc_ndirty; i++) {
+		b = bc_dirty[i];
+		if (!va_is_writable(diskaddr(b)) || bc_is_held(b))
+			continue;
+		for (j = n; j > 0 && bc_dirty[j - 1] > b; j--)
+			bc_dirty[j] = bc_dirty[j - 1];
+		if (j > 0 && bc_dirty[j - 1] == b) {
+			// Already listed; undo the shift
+			for (; j < n; j++)
+				bc_dirty[j] = bc_dirty[j + 1];
+			continue;
 		}
+		bc_dirty[j] = b;
+		n++;
 	}
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && j - i < BC_CLUSTER_MAX &&
+			     bc_dirty[j] == bc_dirty[j - 1] + 1; j++)
+			/* do nothing */;
+		bc_write_cluster(bc_dirty[i], j - i);
+	}
+	bc_ndirty = 0;
+	for (i = 0; i < bc_nheld; i++)
+		if (va_is_writable(diskaddr(bc_held[i])))
+			bc_dirty[bc_ndirty++] = bc_held[i];
+	if (bc_ndirty)
+		vsys_clock_gettime(CLOCK_MONOTONIC, &bc_dirty_since);
+}
+
+// Deferred write-back: is the dirty data old enough, or is there a lot
+// of it?  Then the server syncs (fs_writeback).
+bool
+bc_writeback_due(void)
+{
+	struct timespec now;
+
+	if (bc_ndirty == 0)
+		return 0;
+	if (bc_ndirty >= BC_WB_HIGH)
+		return 1;
+	vsys_clock_gettime(CLOCK_MONOTONIC, &now);
+	now = sub_timespec(&now, &bc_dirty_since);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000 >= BC_WB_DELAY_MS;
+}
+
+// Limit the cache to n blocks, evicting blocks if it holds more.  The
+// limit is clamped to [BC_CLUSTER_MAX, BC_NBLOCKS]: a single
+// instruction may touch two cached blocks, and a cluster read maps up
+// to BC_CLUSTER_MAX.
+void
+bc_set_limit(int n)
+{
+	n = MIN(MAX(n, BC_CLUSTER_MAX), BC_NBLOCKS);
+	mutex_lock(&bc_lock);
+	bc_limit = n;
+	while (bc_nframes > bc_limit)
+		bc_evict(0);
+	mutex_unlock(&bc_lock);
+}
+
+// Copy out the cache counters.
+void
+bc_get_stats(struct Fscachestat *st)
+{
+	*st = bc_stats;
+	st->cs_nblocks = bc_nframes;
+	st->cs_limit = bc_limit;
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -132,6 +544,7 @@ void
 bc_init(void)
 {
 	struct Super super;
+	bc_limit = BC_NBLOCKS;
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
@@ -0,0 +1,79 @@
+/*
+ * Path lookup cache.
+ *
+ * walk_path looks up every component of a path in its directory.  The
+ * cache remembers the outcome of each (directory, name) lookup, both
+ * the entry found and the fact that there was none, so that opening the
+ * same paths again, or probing for files that do not exist, costs one
+ * hash and one string compare per component.
+ *
+ * The table is direct-mapped: a new entry simply replaces whatever was
+ * in its slot, and a key always lands in the same slot, so entering a
+ * fresh result for a name overwrites any stale one.  file_create and
+ * file_remove do exactly that.  Removing a directory flushes the whole
+ * cache, since its struct File may be reused for an unrelated
+ * directory while entries naming it as parent are still around.
+ */
+
+#include "fs.h"
+
+#define NDENTRY_SHIFT	8
+#define NDENTRY		(1 << NDENTRY_SHIFT)
+
+struct Dentry {
+	struct File *dir;	// Directory looked in, NULL if the slot is unused
+	struct File *f;		// Entry found, NULL if there was none
+	uint32_t hash;
+	char name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[NDENTRY] FS_SHARED;
+// Readers of the file system update the cache too, so it has a lock
+static struct mutex dcache_lock FS_SHARED;
+
+static struct Dentry *
+dcache_slot(struct File *dir, const char *name, uint32_t *hash)
+{
+	*hash = name_hash(name) ^ (uintptr_t) dir;
+	return &dcache[(*hash * 2654435761U) >> (32 - NDENTRY_SHIFT)];
+}
+
+// If the lookup of name in dir is cached, set *pf to its result (NULL
+// if there is no such entry) and return true.
+bool
+dcache_lookup(struct File *dir, const char *name, struct File **pf)
+{
+	uint32_t hash;
+	struct Dentry *d = dcache_slot(dir, name, &hash);
+	bool hit;
+
+	mutex_lock(&dcache_lock);
+	if ((hit = d->dir == dir && d->hash == hash && strcmp(d->name, name) == 0))
+		*pf = d->f;
+	mutex_unlock(&dcache_lock);
+	return hit;
+}
+
+// Record that name in dir is f, or that there is no such entry if f
+// is NULL.
+void
+dcache_enter(struct File *dir, const char *name, struct File *f)
+{
+	uint32_t hash;
+	struct Dentry *d = dcache_slot(dir, name, &hash);
+
+	mutex_lock(&dcache_lock);
+	d->dir = dir;
+	d->f = f;
+	d->hash = hash;
+	strcpy(d->name, name);
+	mutex_unlock(&dcache_lock);
+}
+
+void
+dcache_flush(void)
+{
+	mutex_lock(&dcache_lock);
+	memset(dcache, 0, sizeof(dcache));
+	mutex_unlock(&dcache_lock);
+}
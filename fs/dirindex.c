@@ -0,0 +1,246 @@
+/*
+ * In-memory hashed directory index.
+ *
+ * A directory is a flat array of struct File, so dir_lookup compares
+ * the name of every entry and dir_alloc_file scans for a free one.
+ * For directories of more than a block, the first lookup builds an
+ * index: an open-addressing hash table from name to entry, plus a
+ * stack of free entries.  Nothing goes to disk, so the on-disk format
+ * does not change and an index can be dropped and rebuilt at will.
+ *
+ * Entries are kept as pointers into the block cache.  A directory's
+ * blocks always live at the same DISKMAP address, so the pointers stay
+ * valid even if their pages are evicted and read back later.
+ *
+ * The server's worker envs share the indexes, tables included; lookups
+ * hold dirindex_lock (fs.c) while they use one.
+ */
+
+#include "fs.h"
+
+// Directories smaller than this are scanned instead
+#define DIRINDEX_MIN_BLOCKS	2
+// Indexes kept at a time; the least recently used one is dropped
+#define NDIRINDEX		8
+// Address space for each index's table and free stack
+#define DIRINDEX_SPAN		(4 * 1024 * 1024)
+
+struct DirSlot {
+	uint32_t hash;
+	struct File *f;		// NULL if the slot is empty
+};
+
+// Marks a slot whose entry was removed, so that probes go on past it
+#define DIRSLOT_DELETED	((struct File *) 1)
+
+struct DirIndex {
+	struct File *dir;	// Directory indexed, NULL if unused
+	uint32_t lru;		// Last use, for replacement
+	uint32_t mask;		// Hash table size - 1
+	struct DirSlot *table;
+	uint32_t nused;		// Entries in the table
+	uint32_t ndeleted;	// DIRSLOT_DELETED slots in the table
+	struct File **free;	// Stack of free entries
+	uint32_t nfree;
+	uint32_t cap;		// Most entries (used + free) it can hold
+	size_t bytes;		// Memory mapped for table and free stack
+};
+
+static struct DirIndex dirindex[NDIRINDEX] FS_SHARED;
+static uint32_t dirindex_clock FS_SHARED;
+
+// FNV-1a
+uint32_t
+name_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
+static void
+dirindex_drop(struct DirIndex *ix)
+{
+	size_t off;
+
+	for (off = 0; off < ix->bytes; off += PGSIZE)
+		sys_page_unmap(0, (char *) ix->table + off);
+	memset(ix, 0, sizeof(*ix));
+}
+
+// Slot holding name, or the empty slot where it would go.
+static struct DirSlot *
+dirindex_probe(struct DirIndex *ix, const char *name, uint32_t hash)
+{
+	struct DirSlot *s;
+	uint32_t i;
+
+	for (i = hash & ix->mask; ; i = (i + 1) & ix->mask) {
+		s = &ix->table[i];
+		if (!s->f)
+			return s;
+		if (s->f != DIRSLOT_DELETED && s->hash == hash
+		    && strcmp(s->f->f_name, name) == 0)
+			return s;
+	}
+}
+
+static void
+dirindex_add_entry(struct DirIndex *ix, struct File *f)
+{
+	struct DirSlot *s;
+	uint32_t hash;
+
+	if (f->f_name[0] == '\0') {
+		ix->free[ix->nfree++] = f;
+		return;
+	}
+	hash = name_hash(f->f_name);
+	s = dirindex_probe(ix, f->f_name, hash);
+	if (!s->f) {
+		s->hash = hash;
+		s->f = f;
+		ix->nused++;
+	}
+}
+
+// Index dir, sized for twice its current number of entries so that it
+// can grow for a while before it has to be rebuilt.
+static int
+dirindex_build(struct DirIndex *ix, struct File *dir)
+{
+	uint32_t nblock = dir->f_size / BLKSIZE, i, j, tsize;
+	size_t off;
+	char *blk;
+	int r;
+
+	static_assert(NDIRINDEX * DIRINDEX_SPAN <= DIRINDEX_SIZE);
+
+	ix->cap = 2 * nblock * BLKFILES;
+	for (tsize = 1; tsize < 2 * ix->cap; tsize <<= 1)
+		/* do nothing */;
+	ix->bytes = ROUNDUP(tsize * sizeof(struct DirSlot)
+			    + ix->cap * sizeof(struct File *), PGSIZE);
+	if (ix->bytes > DIRINDEX_SPAN)
+		return -E_NO_MEM;
+
+	ix->table = (struct DirSlot *) (DIRINDEX_VA + (ix - dirindex) * DIRINDEX_SPAN);
+	ix->free = (struct File **) (ix->table + tsize);
+	ix->mask = tsize - 1;
+	for (off = 0; off < ix->bytes; off += PGSIZE)
+		if ((r = sys_page_alloc(0, (char *) ix->table + off,
+					PTE_P|PTE_U|PTE_W)) < 0) {
+			ix->bytes = off;
+			return r;
+		}
+
+	ix->dir = dir;
+	for (i = 0; i < nblock; i++) {
+		if ((r = file_get_block(dir, i, &blk)) < 0)
+			return r;
+		for (j = 0; j < BLKFILES; j++)
+			dirindex_add_entry(ix, (struct File *) blk + j);
+	}
+	return 0;
+}
+
+// Return the index for dir, building it if need be, or NULL if dir
+// should just be scanned.
+struct DirIndex *
+dirindex_get(struct File *dir)
+{
+	struct DirIndex *ix, *victim = &dirindex[0];
+
+	for (ix = dirindex; ix < dirindex + NDIRINDEX; ix++) {
+		if (ix->dir == dir) {
+			ix->lru = ++dirindex_clock;
+			return ix;
+		}
+		if (ix->lru < victim->lru)
+			victim = ix;
+	}
+
+	if (dir->f_size / BLKSIZE < DIRINDEX_MIN_BLOCKS)
+		return NULL;
+	if (victim->dir || victim->bytes)
+		dirindex_drop(victim);
+	if (dirindex_build(victim, dir) < 0) {
+		dirindex_drop(victim);
+		return NULL;
+	}
+	victim->lru = ++dirindex_clock;
+	return victim;
+}
+
+// Find the entry called name: one hash probe, in the common case.
+// Returns 0 and sets *file on success, -E_NOT_FOUND if there is none.
+int
+dirindex_lookup(struct DirIndex *ix, const char *name, struct File **file)
+{
+	struct DirSlot *s = dirindex_probe(ix, name, name_hash(name));
+
+	if (!s->f)
+		return -E_NOT_FOUND;
+	*file = s->f;
+	return 0;
+}
+
+// Pop a free entry, or return NULL if the directory is full.
+struct File *
+dirindex_alloc(struct DirIndex *ix)
+{
+	return ix->nfree ? ix->free[--ix->nfree] : NULL;
+}
+
+// Record that f, an entry dirindex_alloc handed out, now has a name.
+void
+dirindex_insert(struct DirIndex *ix, struct File *f)
+{
+	dirindex_add_entry(ix, f);
+}
+
+// Record a block of free entries just added to the directory.
+// Drops the index if it has no room left; the next dirindex_get
+// rebuilds it, twice as large.
+void
+dirindex_add_block(struct DirIndex *ix, struct File *blk)
+{
+	uint32_t j;
+
+	if (ix->nused + ix->nfree + BLKFILES > ix->cap) {
+		dirindex_drop(ix);
+		return;
+	}
+	for (j = 0; j < BLKFILES; j++)
+		dirindex_add_entry(ix, blk + j);
+}
+
+// Record that f, a named entry, is about to be cleared.  Its slot
+// becomes a DIRSLOT_DELETED marker; once those take up a quarter of the
+// table, the index is dropped so that probes stay short.
+void
+dirindex_remove(struct DirIndex *ix, struct File *f)
+{
+	struct DirSlot *s = dirindex_probe(ix, f->f_name, name_hash(f->f_name));
+
+	if (s->f != f)
+		return;
+	s->f = DIRSLOT_DELETED;
+	ix->nused--;
+	ix->free[ix->nfree++] = f;
+	if (++ix->ndeleted > ix->mask / 4)
+		dirindex_drop(ix);
+}
+
+// Drop dir's index, if it has one; dir is going away.
+void
+dirindex_forget(struct File *dir)
+{
+	struct DirIndex *ix;
+
+	for (ix = dirindex; ix < dirindex + NDIRINDEX; ix++)
+		if (ix->dir == dir)
+			dirindex_drop(ix);
+}
@@ -1,5 +1,6 @@
 #include <inc/string.h>
 #include <inc/partition.h>
+#include <inc/x86.h>
 
 #include "fs.h"
 
@@ -20,6 +21,66 @@ check_super(void)
 	//cprintf("superblock is good\n");
 }
 
+// --------------------------------------------------------------
+// Locking
+// --------------------------------------------------------------
+
+// The file server's worker envs (serv.c) share the file system.
+// Requests that change it -- the bitmap, a struct File, a directory --
+// hold fs_lock for writing (fs_wlock); the others hold it for
+// reading, and may then only change the caches, which have locks of
+// their own, and commit the metadata log, which has one too.
+struct rwlock fs_lock FS_SHARED;
+
+// Protects the directory indexes, which lookups build and replace
+static struct mutex dirindex_lock FS_SHARED;
+
+// Operations that change the file system run in steps, each of which
+// leaves it consistent and fits in one transaction of the metadata log
+// (log.c): if the log commits in between, a crash finds a whole number
+// of steps done.  A step changes a bitmap block for each block it
+// allocates or frees, up to all of them, and at most six others: a
+// File, its directory's File and a directory block, or a File and its
+// pointer blocks.  Writes and truncates go WRITE_STEP and TRUNC_STEP
+// blocks a step, which keeps them within two second-level pointer
+// blocks.
+#define STEP_NOTBITMAP	6
+#define WRITE_STEP	NINDIRECT
+#define TRUNC_STEP	NINDIRECT
+
+// Most metadata blocks one step changes
+static int
+fs_step_blocks(void)
+{
+	return STEP_NOTBITMAP + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Take fs_lock for writing, with room in the log for a step.  If the
+// running transaction is too full, it is committed first, holding
+// fs_lock only for reading, so that readers do not wait behind the
+// log write.  Release the lock with rw_wunlock.
+void
+fs_wlock(void)
+{
+	for (;;) {
+		rw_wlock(&fs_lock);
+		if (log_space() >= fs_step_blocks())
+			return;
+		rw_wunlock(&fs_lock);
+		rw_rlock(&fs_lock);
+		log_commit();
+		rw_runlock(&fs_lock);
+	}
+}
+
+// Start the next step of an operation, holding fs_lock for writing.
+// Only an operation too big for one step commits the log here.
+static void
+fs_step(void)
+{
+	log_reserve(fs_step_blocks());
+}
+
 // --------------------------------------------------------------
 // Free block bitmap
 // --------------------------------------------------------------
@@ -36,6 +97,15 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// Free blocks per bitmap block, so that the allocator can skip a
+// full stretch of BLKBITSIZE blocks without reading its bitmap.
+static uint32_t bitmap_nfree[DISKSIZE / BLKSIZE / BLKBITSIZE] FS_SHARED;
+
+// Where the next allocation without a goal starts looking.  It moves
+// round the disk, so repeated allocations do not rescan the full
+// blocks at its start.
+static uint32_t alloc_cursor FS_SHARED;
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -43,40 +113,109 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	log_write(&bitmap[blockno / 32]);
+	if (!block_is_free(blockno))
+		bitmap_nfree[blockno / BLKBITSIZE]++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Return the first block in [b, end) whose bitmap bit equals 'free',
+// or end if there is none.  Works a word at a time and skips whole
+// bitmap blocks using bitmap_nfree.
+static uint32_t
+bitmap_next(uint32_t b, uint32_t end, bool free)
+{
+	uint32_t w;
+
+	while (b < end) {
+		if (bitmap_nfree[b / BLKBITSIZE] == (free ? 0 : BLKBITSIZE)) {
+			b = ROUNDUP(b + 1, BLKBITSIZE);
+			continue;
+		}
+		w = (free ? bitmap[b / 32] : ~bitmap[b / 32]) & (~0U << (b % 32));
+		if (w)
+			return MIN(ROUNDDOWN(b, 32) + bsf(w), end);
+		b = ROUNDDOWN(b, 32) + 32;
+	}
+	return end;
+}
+
+// Find n consecutive free blocks starting in [from, end) and ending
+// by end.  Returns the first, or 0 (always in use) if there are none.
+static uint32_t
+bitmap_find_run(uint32_t from, uint32_t end, uint32_t n)
+{
+	uint32_t b, e;
+
+	for (b = bitmap_next(from, end, 1); b < end; b = bitmap_next(e, end, 1)) {
+		e = bitmap_next(b, MIN(end, b + n), 0);
+		if (e - b == n)
+			return b;
+	}
+	return 0;
+}
+
+// Allocate n consecutive blocks, as close after 'goal' as possible:
+// search from goal to the end of the disk, then wrap around.
+//
+// Return the first block number allocated on success,
+// -E_NO_DISK if there is no such run.
+//
+// The bitmap blocks are not flushed here: they join the running log
+// transaction (log.c), which commits them together with the blocks
+// that use the allocation.
+int
+alloc_blocks(uint32_t goal, uint32_t n)
+{
+	uint32_t b, i, nblocks = super->s_nblocks;
+
+	if (n == 0 || n > nblocks)
+		return -E_INVAL;
+	if (goal >= nblocks)
+		goal = 0;
+	if (!(b = bitmap_find_run(goal, nblocks, n)) &&
+	    !(b = bitmap_find_run(0, MIN(nblocks, goal + n - 1), n)))
+		return -E_NO_DISK;
+
+	for (i = b; i < b + n; i++) {
+		if (i == b || i % BLKBITSIZE == 0)
+			log_write(&bitmap[i / 32]);
+		bitmap[i / 32] &= ~(1 << (i % 32));
+		bitmap_nfree[i / BLKBITSIZE]--;
+		bc_fresh(i);
+	}
+	return b;
+}
+
+// Search the bitmap for a free block and allocate it.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	int r;
 
-	// LAB 10: Your code here.
-	uint32_t blockno;
-	for (blockno = 0; blockno < super->s_nblocks; blockno++) {
-		if (bitmap[blockno / 32] & (1 << (blockno % 32))) {
-			bitmap[blockno / 32] &= ~(1 << (blockno % 32));
-			flush_block((void *)&bitmap[blockno / 32]);
-			return blockno;
-		}
-	}
-	return -E_NO_DISK;
+	if ((r = alloc_blocks(alloc_cursor, 1)) >= 0)
+		alloc_cursor = r + 1;
+	return r;
+}
+
+// Count the free blocks covered by each bitmap block.
+static void
+bitmap_count(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < super->s_nblocks; i++)
+		if (block_is_free(i))
+			bitmap_nfree[i / BLKBITSIZE]++;
 }
 
 // Validate the file system bitmap.
 //
-// Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
-// are all marked as in-use.
+// Check that all reserved blocks -- 0, 1, the bitmap blocks themselves,
+// and the log -- are all marked as in-use.
 void
 check_bitmap(void)
 {
@@ -85,6 +224,8 @@ check_bitmap(void)
 	// Make sure all bitmap blocks are marked in-use
 	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
 		assert(!block_is_free(2+i));
+	for (i = 0; i < super->s_nlog; i++)
+		assert(!block_is_free(super->s_log + i));
 
 	// Make sure the reserved and root blocks are marked in-use.
 	assert(!block_is_free(0));
@@ -104,63 +245,195 @@ void
 fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
+	// Every step fits in the log, however big the disk
+	static_assert(STEP_NOTBITMAP + (DISKSIZE / BLKSIZE + BLKBITSIZE - 1) / BLKBITSIZE
+		      <= LOG_MAX);
 
        // Find a JOS disk.  Use the second IDE disk (number 1) if availabl
        if (ide_probe_disk1())
                ide_set_disk(1);
        else
                ide_set_disk(0);
+	ide_dma_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	log_init();
 
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
+	bitmap_count();
 	
 }
 
-// Find the disk block number slot for the 'filebno'th block in file 'f'.
-// Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
-// if necessary.
+// Number of file blocks, counting from 0, that f's extents map.
+static uint32_t
+file_extent_blocks(struct File *f)
+{
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < NEXTENT && f->f_extent[i].e_len; i++)
+		n += f->f_extent[i].e_len;
+	return n;
+}
+
+// Has f gone over to block pointers?  Then its extents are frozen.
+static bool
+file_uses_pointers(struct File *f)
+{
+	return f->f_indirect || f->f_dindirect;
+}
+
+// Map disk blocks [start, start + n) as the next file blocks after the
+// extents, growing the last extent if the run continues it.
+// Returns 0 on success, -E_NO_MEM if every extent is in use.
+static int
+file_extent_append(struct File *f, uint32_t start, uint32_t n)
+{
+	struct Extent *e;
+	int i;
+
+	log_write(f);
+	for (i = 0; i < NEXTENT && f->f_extent[i].e_len; i++)
+		/* do nothing */;
+	if (i > 0) {
+		e = &f->f_extent[i - 1];
+		if (e->e_start + e->e_len == start) {
+			e->e_len += n;
+			return 0;
+		}
+	}
+	if (i == NEXTENT)
+		return -E_NO_MEM;
+	f->f_extent[i].e_start = start;
+	f->f_extent[i].e_len = n;
+	return 0;
+}
+
+// Make *pblk refer to a block of pointers, allocating a zeroed one if
+// there is none and 'alloc' is set.
+static int
+file_pointer_block(uint32_t *pblk, bool alloc)
+{
+	int r;
+
+	if (*pblk)
+		return 0;
+	if (!alloc)
+		return -E_NOT_FOUND;
+	if ((r = alloc_block()) < 0)
+		return r;
+	log_write(diskaddr(r));
+	memset(diskaddr(r), 0, BLKSIZE);
+	log_write(pblk);
+	*pblk = r;
+	return 0;
+}
+
+// Find the block pointer slot for the 'filebno'th block in file 'f'.
+// Set '*ppdiskbno' to point to that slot, an entry in the indirect
+// block or in one of the blocks the double-indirect block points to.
+// When 'alloc' is set, this function will allocate those blocks if
+// necessary.  Only blocks beyond the extents use these slots.
 //
 // Returns:
 //	0 on success (but note that *ppdiskbno might equal 0).
-//	-E_NOT_FOUND if the function needed to allocate an indirect block, but
+//	-E_NOT_FOUND if the function needed to allocate a pointer block, but
 //		alloc was 0.
-//	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_NO_DISK if there's no space on the disk for a pointer block.
+//	-E_INVAL if filebno is out of range (it's >= MAXFILEBLOCKS).
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
-    // LAB 10: Your code here.
-    if (filebno < NDIRECT)
-		*ppdiskbno = &f->f_direct[filebno];
-	else if (filebno < (NDIRECT + NINDIRECT)) {
-		if (f->f_indirect) {
-			*ppdiskbno = &((uint32_t *) diskaddr(f->f_indirect))[filebno - NDIRECT];
-		} else if (alloc && !f->f_indirect) {
-			uint32_t new_blockno = alloc_block();
-			if (!new_blockno){
-				return -E_NO_DISK;
-			}
-			memset(diskaddr(new_blockno), 0, BLKSIZE);
-			f->f_indirect = new_blockno;
-			*ppdiskbno = &((uint32_t *) diskaddr(f->f_indirect))[filebno - NDIRECT];
-		} else if (!alloc && !f->f_indirect){
-			return -E_NOT_FOUND;
+	uint32_t *pblk;
+	int r;
+
+	if (filebno < NINDIRECT)
+		pblk = &f->f_indirect;
+	else if (filebno < MAXFILEBLOCKS) {
+		filebno -= NINDIRECT;
+		if ((r = file_pointer_block(&f->f_dindirect, alloc)) < 0)
+			return r;
+		pblk = &((uint32_t *) diskaddr(f->f_dindirect))[filebno / NINDIRECT];
+		filebno %= NINDIRECT;
+	} else
+		return -E_INVAL;
+
+	if ((r = file_pointer_block(pblk, alloc)) < 0)
+		return r;
+	*ppdiskbno = &((uint32_t *) diskaddr(*pblk))[filebno];
+	return 0;
+}
+
+// Find where file blocks [filebno, filebno + n) live on disk, for
+// n >= 1.  Set *diskbno to the disk block holding block filebno, or to
+// 0 if it is a hole, and return how many of the n blocks continue the
+// same run: consecutive on disk, or all holes.  A block in an extent
+// costs one lookup per extent rather than one walk per block.
+//
+// Returns < 0 on error:
+//	-E_INVAL if filebno is out of range.
+int
+file_map_range(struct File *f, uint32_t filebno, uint32_t n, uint32_t *diskbno)
+{
+	uint32_t base = 0, len, b, *p;
+	struct Extent *e;
+	int i;
+
+	for (i = 0; i < NEXTENT && f->f_extent[i].e_len; i++) {
+		e = &f->f_extent[i];
+		if (filebno < base + e->e_len) {
+			*diskbno = e->e_start + (filebno - base);
+			return MIN(n, base + e->e_len - filebno);
 		}
-	} else {
+		base += e->e_len;
+	}
+
+	if (filebno >= MAXFILEBLOCKS)
 		return -E_INVAL;
+	n = MIN(n, MAXFILEBLOCKS - filebno);
+	for (len = 0; len < n; len++) {
+		if (file_block_walk(f, filebno + len, &p, 0) < 0)
+			b = 0;
+		else
+			b = *p;
+		if (len == 0)
+			*diskbno = b;
+		else if (b != (*diskbno ? *diskbno + len : 0))
+			break;
+	}
+	return len;
+}
+
+// Allocate a disk block for file block filebno, which must be a hole.
+// The block goes right after the file's previous block if possible,
+// and onto the extents if it is the next block they would map.
+static int
+file_alloc_block(struct File *f, uint32_t filebno)
+{
+	uint32_t goal = alloc_cursor, prev, *p;
+	int r, b;
+
+	if (filebno > 0 && file_map_range(f, filebno - 1, 1, &prev) > 0 && prev)
+		goal = prev + 1;
+	if ((b = alloc_blocks(goal, 1)) < 0)
+		return b;
+
+	if (filebno == file_extent_blocks(f) && !file_uses_pointers(f)
+	    && file_extent_append(f, b, 1) == 0)
+		return 0;
+	if ((r = file_block_walk(f, filebno, &p, 1)) < 0) {
+		free_block(b);
+		return r;
 	}
+	log_write(p);
+	*p = b;
 	return 0;
 }
 
@@ -170,30 +443,48 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	// LAB 10: Your code here.
+	uint32_t diskbno;
 	int r;
-	uint32_t *pblockno;
-	r = file_block_walk(f, filebno, &pblockno, 1);
-	if (r < 0) {
-		return r;
-	}
 
-	if (!*pblockno) {
-		*pblockno = alloc_block();
-		if (*pblockno < 0){
-			return -E_NO_DISK;
-		}
+	if ((r = file_map_range(f, filebno, 1, &diskbno)) < 0)
+		return r;
+	if (!diskbno) {
+		if ((r = file_alloc_block(f, filebno)) < 0)
+			return r;
+		file_map_range(f, filebno, 1, &diskbno);
 	}
 
-	*blk = (char *) diskaddr(*pblockno);
+	bc_lookup(diskbno);
+	*blk = (char *) diskaddr(diskbno);
 	return 0;
 }
 
+// Give file blocks [filebno, filebno + n), the next blocks after the
+// extents, one run of consecutive disk blocks in a single extent, so
+// that a large write lays the file out sequentially.  A best effort:
+// file_get_block still allocates whatever is missing one block at a
+// time.
+static void
+file_alloc_run(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t goal = alloc_cursor, prev;
+	int b;
+
+	if (n == 0 || filebno != file_extent_blocks(f) || file_uses_pointers(f))
+		return;
+	if (filebno > 0 && file_map_range(f, filebno - 1, 1, &prev) > 0 && prev)
+		goal = prev + 1;
+	if ((b = alloc_blocks(goal, n)) < 0)
+		return;
+	if (file_extent_append(f, b, n) < 0)
+		while (n > 0)
+			free_block(b + --n);
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -205,11 +496,20 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	uint32_t i, j, nblock;
 	char *blk;
 	struct File *f;
+	struct DirIndex *ix;
 
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
+	mutex_lock(&dirindex_lock);
+	if ((ix = dirindex_get(dir)) != NULL) {
+		r = dirindex_lookup(ix, name, file);
+		mutex_unlock(&dirindex_lock);
+		return r;
+	}
+	mutex_unlock(&dirindex_lock);
+
 	nblock = dir->f_size / BLKSIZE;
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
@@ -233,23 +533,38 @@ dir_alloc_file(struct File *dir, struct File **file)
 	uint32_t nblock, i, j;
 	char *blk;
 	struct File *f;
+	struct DirIndex *ix;
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
-			return r;
-		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
-	}
+	if ((ix = dirindex_get(dir)) != NULL) {
+		if ((*file = dirindex_alloc(ix)) != NULL)
+			return 0;
+		i = nblock;
+	} else
+		for (i = 0; i < nblock; i++) {
+			if ((r = file_get_block(dir, i, &blk)) < 0)
+				return r;
+			f = (struct File*) blk;
+			for (j = 0; j < BLKFILES; j++)
+				if (f[j].f_name[0] == '\0') {
+					*file = &f[j];
+					return 0;
+				}
+		}
+	log_write(dir);
 	dir->f_size += BLKSIZE;
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
+	// The block may hold whatever was last stored in it
+	log_write(blk);
+	memset(blk, 0, BLKSIZE);
 	f = (struct File*) blk;
+	if (ix) {
+		dirindex_add_block(ix, f);
+		if ((*file = dirindex_alloc(ix)) != NULL)
+			return 0;
+	}
 	*file = &f[0];
 	return 0;
 }
@@ -301,7 +616,13 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if (dcache_lookup(dir, name, &f))
+			r = f ? 0 : -E_NOT_FOUND;
+		else if ((r = dir_lookup(dir, name, &f)) == 0)
+			dcache_enter(dir, name, f);
+		else if (r == -E_NOT_FOUND)
+			dcache_enter(dir, name, NULL);
+		if (r < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -331,6 +652,7 @@ file_create(const char *path, struct File **pf)
 	char name[MAXNAMELEN];
 	int r;
 	struct File *dir, *f;
+	struct DirIndex *ix;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
@@ -339,9 +661,40 @@ file_create(const char *path, struct File **pf)
 	if ((r = dir_alloc_file(dir, &f)) < 0)
 		return r;
 
+	log_write(f);
 	strcpy(f->f_name, name);
+	if ((ix = dirindex_get(dir)) != NULL)
+		dirindex_insert(ix, f);
+	dcache_enter(dir, name, f);
 	*pf = f;
-	file_flush(dir);
+	return 0;
+}
+
+// Remove "path": free its blocks and clear its directory entry.
+int
+file_remove(const char *path)
+{
+	int r;
+	struct File *dir, *f;
+	struct DirIndex *ix;
+
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	if (dir == 0)
+		return -E_BAD_PATH;
+
+	if ((r = file_set_size(f, 0)) < 0)
+		return r;
+	if ((ix = dirindex_get(dir)) != NULL)
+		dirindex_remove(ix, f);
+	dcache_enter(dir, f->f_name, NULL);
+	if (f->f_type == FTYPE_DIR) {
+		dirindex_forget(f);
+		dcache_flush();
+	}
+	fs_step();
+	log_write(f);
+	memset(f, 0, sizeof(*f));
 	return 0;
 }
 
@@ -353,6 +706,74 @@ file_open(const char *path, struct File **pf)
 	return walk_path(path, 0, pf, 0);
 }
 
+// Read-ahead window, in blocks.  It starts at RA_MIN, doubles on each
+// read that continues where the previous one on the same file ended,
+// and falls back to RA_MIN on any other read.  The worker envs share
+// this state without a lock: a lost update only costs a worse guess.
+#define RA_MIN		4
+#define RA_MAX		BC_CLUSTER_MAX
+
+static struct File *ra_file FS_SHARED;	// File of the previous read
+static uint32_t ra_next FS_SHARED;	// Block the next sequential read starts in
+static int ra_window FS_SHARED;
+
+// Bring file blocks [filebno, filebno + n) into the block cache,
+// reading each run of blocks that are contiguous on disk and not yet
+// cached with one bc_read_cluster.  The pointer blocks they are mapped
+// through come in on the way.
+void
+file_prefetch(struct File *f, uint32_t filebno, int n)
+{
+	uint32_t diskbno;
+	int i, len, r = 0;
+
+	n = MIN(n, (int) (ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE - filebno));
+	for (; n > 0; n -= len, filebno += len) {
+		if ((len = file_map_range(f, filebno, n, &diskbno)) <= 0)
+			break;
+		for (i = 0; diskbno && i < len; i += (r > 0 ? r : 1))
+			r = bc_read_cluster(diskbno + i, len - i);
+	}
+}
+
+// Bring f's pointer blocks into the block cache: truncating f reads
+// them all.
+void
+file_prefetch_pointers(struct File *f)
+{
+	uint32_t *pblks;
+	int i;
+
+	if (f->f_indirect)
+		bc_read_cluster(f->f_indirect, 1);
+	if (f->f_dindirect) {
+		pblks = (uint32_t *) diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (pblks[i])
+				bc_read_cluster(pblks[i], 1);
+	}
+}
+
+// Is some block in file blocks [filebno, filebno + n) on disk but not
+// in the block cache?  Looks up every block, so that each counts as a
+// cache hit or miss.
+static bool
+file_blocks_missing(struct File *f, uint32_t filebno, int n)
+{
+	uint32_t diskbno;
+	int i, len;
+	bool missing = 0;
+
+	for (; n > 0; n -= len, filebno += len) {
+		if ((len = file_map_range(f, filebno, n, &diskbno)) <= 0)
+			break;
+		for (i = 0; diskbno && i < len; i++)
+			if (!bc_lookup(diskbno + i))
+				missing = 1;
+	}
+	return missing;
+}
+
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
 // Returns the number of bytes read, < 0 on error.
@@ -360,6 +781,7 @@ ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
 {
 	int r, bn;
+	uint32_t filebno, nblocks, diskbno;
 	off_t pos;
 	char *blk;
 
@@ -368,11 +790,31 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 
 	count = MIN(count, f->f_size - offset);
 
+	// Sequential reader?  Then widen the window.  Only go to the disk
+	// when a block this read needs is missing, and then fetch the
+	// whole window at once.
+	filebno = offset / BLKSIZE;
+	nblocks = (offset + count - 1) / BLKSIZE - filebno + 1;
+	if (f == ra_file && filebno == ra_next)
+		ra_window = MIN(ra_window * 2, RA_MAX);
+	else
+		ra_window = RA_MIN;
+	ra_file = f;
+	ra_next = (offset + count) / BLKSIZE;
+	if (file_blocks_missing(f, filebno, nblocks))
+		file_prefetch(f, filebno, MAX(nblocks, (uint32_t) ra_window));
+
+	// Holes read as zeros; reading does not allocate them, since a
+	// reader does not hold fs_lock for writing.
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_map_range(f, pos / BLKSIZE, 1, &diskbno)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(buf, blk + pos % BLKSIZE, bn);
+		if (diskbno) {
+			blk = diskaddr(diskbno);
+			memmove(buf, blk + pos % BLKSIZE, bn);
+		} else
+			memset(buf, 0, bn);
 		pos += bn;
 		buf += bn;
 	}
@@ -389,109 +831,206 @@ int
 file_write(struct File *f, const void *buf, size_t count, off_t offset)
 {
 	int r, bn;
-	off_t pos;
+	off_t pos, end;
 	char *blk;
+	bool extend;
+
+	if (offset < 0 || count > MAXFILESIZE || offset > MAXFILESIZE - count)
+		return -E_INVAL;
 
 	// Extend file if necessary
-	if (offset + count > f->f_size)
-		if ((r = file_set_size(f, offset + count)) < 0)
-			return r;
+	extend = offset + count > f->f_size;
+	if (extend && (r = file_set_size(f, offset + count)) < 0)
+		return r;
 
+	// A step at a time: one that fails or is cut short by a crash
+	// leaves the file's tail a hole
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
-			return r;
-		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
-		memmove(blk + pos % BLKSIZE, buf, bn);
-		pos += bn;
-		buf += bn;
+		end = MIN(offset + count, ROUNDDOWN(pos, BLKSIZE) + WRITE_STEP * BLKSIZE);
+		if (pos > offset)
+			fs_step();
+		if (extend && end - pos > BLKSIZE)
+			file_alloc_run(f, ROUNDUP(pos, BLKSIZE) / BLKSIZE,
+				       end / BLKSIZE - ROUNDUP(pos, BLKSIZE) / BLKSIZE);
+		for (; pos < end; pos += bn, buf += bn) {
+			if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+				return r;
+			bn = MIN(BLKSIZE - pos % BLKSIZE, end - pos);
+			memmove(blk + pos % BLKSIZE, buf, bn);
+		}
 	}
 
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
+// Remove a block mapped by a block pointer from file f.  If it's not
+// there, just silently succeed.
 // Returns 0 on success, < 0 on error.
 static int
 file_free_block(struct File *f, uint32_t filebno)
 {
 	int r;
-	uint32_t *ptr;
+	uint32_t bno, *ptr;
 
 	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
-	if (*ptr) {
-		free_block(*ptr);
+		return r == -E_NOT_FOUND ? 0 : r;
+	if ((bno = *ptr)) {
+		log_write(ptr);
 		*ptr = 0;
+		free_block(bno);
 	}
 	return 0;
 }
 
+// Free f's indirect and double-indirect blocks, which must no longer
+// point to any data block.
+static void
+file_free_pointers(struct File *f)
+{
+	uint32_t indirect = f->f_indirect, dindirect = f->f_dindirect, *pblks;
+	int i;
+
+	log_write(f);
+	f->f_indirect = 0;
+	f->f_dindirect = 0;
+	if (indirect)
+		free_block(indirect);
+	if (dindirect) {
+		pblks = (uint32_t *) diskaddr(dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (pblks[i])
+				free_block(pblks[i]);
+		free_block(dindirect);
+	}
+}
+
 // Remove any blocks currently used by file 'f',
 // but not necessary for a file of size 'newsize'.
-// For both the old and new sizes, figure out the number of blocks required,
-// and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// Blocks past the extents are freed through their pointers; extents
+// are cut back to new_nblocks.  Once the extents map the whole file
+// again, the pointer blocks go too, which unfreezes the extents.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	int r, i;
+	uint32_t bno, old_nblocks, new_nblocks, nmapped, base, keep, len, start;
+	struct Extent *e;
 
+	log_write(f);
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
-		if ((r = file_free_block(f, bno)) < 0)
-			cprintf("warning: file_free_block: %i", r);
+	nmapped = file_extent_blocks(f);
+
+	if (file_uses_pointers(f))
+		for (bno = MAX(new_nblocks, nmapped); bno < old_nblocks; bno++)
+			if ((r = file_free_block(f, bno)) < 0)
+				cprintf("warning: file_free_block: %i", r);
 
-	if (new_nblocks <= NDIRECT && f->f_indirect) {
-		free_block(f->f_indirect);
-		f->f_indirect = 0;
+	for (i = 0, base = 0; i < NEXTENT && f->f_extent[i].e_len; i++, base += len) {
+		e = &f->f_extent[i];
+		len = e->e_len;
+		if (base + len <= new_nblocks)
+			continue;
+		keep = base < new_nblocks ? new_nblocks - base : 0;
+		start = e->e_start;
+		e->e_len = keep;
+		if (!keep)
+			e->e_start = 0;
+		for (bno = keep; bno < len; bno++)
+			free_block(start + bno);
 	}
+
+	if (new_nblocks <= nmapped)
+		file_free_pointers(f);
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// Truncates a step of at most TRUNC_STEP blocks at a time, from the
+// end, so that after each step f is a consistent, shorter file.
+// Returns 0 on success, -E_INVAL if newsize is out of range.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
-		file_truncate_blocks(f, newsize);
+	off_t size;
+
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
+	while (f->f_size > newsize) {
+		fs_step();
+		size = MAX(newsize, ROUNDUP(f->f_size, BLKSIZE) - TRUNC_STEP * BLKSIZE);
+		file_truncate_blocks(f, size);
+		f->f_size = size;
+	}
+	log_write(f);
 	f->f_size = newsize;
-	flush_block(f);
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// If the log has a transaction running, committing it writes out
+// everything, f included.  Otherwise only blocks on the block cache's
+// dirty list can need writing, so either walk the file (checking each
+// block against the list is cheap) or, when the list is the shorter of
+// the two, just sync the whole list: writing some other file's blocks
+// early does no harm.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	int i, j, len, nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	uint32_t diskbno, *pblks;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
+	if (log_pending()) {
+		log_commit();
+		return;
+	}
+	if (bc_dirty_count() == 0)
+		return;
+	if (bc_dirty_count() <= nblocks) {
+		bc_sync();
+		return;
+	}
+
+	// Blocks allocated to the file must be marked in use on disk
+	// before anything points to them.
+	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+		flush_block(diskaddr(2 + i));
+
+	for (i = 0; i < nblocks; i += len) {
+		if ((len = file_map_range(f, i, nblocks - i, &diskbno)) <= 0)
+			break;
+		for (j = 0; diskbno && j < len; j++)
+			flush_block(diskaddr(diskbno + j));
 	}
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (f->f_dindirect) {
+		pblks = (uint32_t *) diskaddr(f->f_dindirect);
+		for (j = 0; j < NINDIRECT; j++)
+			if (pblks[j])
+				flush_block(diskaddr(pblks[j]));
+		flush_block(pblks);
+	}
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system, committing the log's running
+// transaction.  Only the dirty blocks are visited, so syncing a mostly
+// clean disk is nearly free.  Called with fs_lock held.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	log_commit();
 }
 
+// Sync the file system if deferred write-back is due (bc.c).
+void
+fs_writeback(void)
+{
+	if (!bc_writeback_due())
+		return;
+	rw_rlock(&fs_lock);
+	log_commit();
+	rw_runlock(&fs_lock);
+}
@@ -4,6 +4,17 @@
 #define SECTSIZE	512			// bytes per disk sector
 #define BLKSECTS	(BLKSIZE / SECTSIZE)	// sectors per block
 
+/* Most blocks the block cache holds at once, not counting the super
+ * block and the bitmap.  The limit can be lowered at run time
+ * (FSREQ_CACHESTAT); override the default with
+ * make DEFS=-DBC_NBLOCKS=n. */
+#ifndef BC_NBLOCKS
+#define BC_NBLOCKS	8192
+#endif
+
+/* Most blocks one disk command can transfer (ide_read takes 256 sectors) */
+#define BC_CLUSTER_MAX	(256 / BLKSECTS)
+
 /* Disk block n, when in memory, is mapped into the file system
  * server's address space at DISKMAP + (n*BLKSIZE). */
 #define DISKMAP		0x10000000
@@ -11,12 +22,41 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Directory indexes (dirindex.c) are mapped from here up */
+#define DIRINDEX_VA	0xE0000000
+#define DIRINDEX_SIZE	0x2000000
+
+/* Most blocks one metadata log transaction can change (log.c): the
+ * log holds them and a header. */
+#define LOG_MAX		(FS_NLOGBLOCKS - 1)
+
+/* Data shared by all of the server's worker envs (serv.c).  Must be
+ * zero-initialized. */
+#define FS_SHARED	__attribute__((section(".bss.fsshared")))
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+/* lock.c */
+struct mutex {
+	volatile uint32_t locked;
+};
+
+struct rwlock {
+	volatile uint32_t state;	// Readers, plus writer flags
+};
+
+void	mutex_lock(struct mutex *m);
+void	mutex_unlock(struct mutex *m);
+void	rw_rlock(struct rwlock *l);
+void	rw_runlock(struct rwlock *l);
+void	rw_wlock(struct rwlock *l);
+void	rw_wunlock(struct rwlock *l);
+
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
+void	ide_dma_init(void);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
@@ -26,23 +66,65 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+int	bc_read_cluster(uint32_t blockno, int n);
+void	bc_fresh(uint32_t blockno);
+int	bc_dirty_count(void);
+void	bc_sync(void);
+bool	bc_writeback_due(void);
+int	bc_hold(void *addr);
+int	bc_held_blocks(uint32_t *blocks);
+void	bc_release(void);
+bool	bc_lookup(uint32_t blockno);
+void	bc_set_limit(int n);
+void	bc_get_stats(struct Fscachestat *st);
 void	bc_init(void);
 
+/* log.c */
+void	log_init(void);
+void	log_write(void *addr);
+bool	log_pending(void);
+int	log_space(void);
+void	log_reserve(int n);
+void	log_commit(void);
+
+/* dirindex.c */
+struct DirIndex;
+uint32_t name_hash(const char *name);
+struct DirIndex *dirindex_get(struct File *dir);
+int	dirindex_lookup(struct DirIndex *ix, const char *name, struct File **file);
+struct File *dirindex_alloc(struct DirIndex *ix);
+void	dirindex_insert(struct DirIndex *ix, struct File *f);
+void	dirindex_add_block(struct DirIndex *ix, struct File *blk);
+void	dirindex_remove(struct DirIndex *ix, struct File *f);
+void	dirindex_forget(struct File *dir);
+
+/* dcache.c */
+bool	dcache_lookup(struct File *dir, const char *name, struct File **pf);
+void	dcache_enter(struct File *dir, const char *name, struct File *f);
+void	dcache_flush(void);
+
 /* fs.c */
+extern struct rwlock fs_lock;
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_map_range(struct File *f, uint32_t filebno, uint32_t n, uint32_t *diskbno);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+void	file_prefetch(struct File *f, uint32_t filebno, int n);
+void	file_prefetch_pointers(struct File *f);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
+void	fs_writeback(void);
+void	fs_wlock(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_blocks(uint32_t goal, uint32_t n);
 
 /* test.c */
 void	fs_test(void);
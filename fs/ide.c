@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers use PCI bus-master DMA and
+ * sleep on IRQ 14 when the controller supports it, and fall back to
+ * PIO otherwise.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -14,6 +16,47 @@
 
 static int diskno = 1;
 
+// PCI configuration space
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+#define PCI_ID		0x00
+#define PCI_COMMAND	0x04
+#define PCI_COMMAND_IO		0x1
+#define PCI_COMMAND_MASTER	0x4
+#define PCI_CLASS	0x08
+#define PCI_BAR4	0x20
+
+// Bus-master IDE registers, relative to BAR4 (primary channel)
+#define BM_CMD		0
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// Device to memory
+#define BM_STATUS	2
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_IRQ	0x04
+#define BM_PRDT		4
+
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+// Physical region descriptor: one physically contiguous piece of a
+// transfer.  A piece never crosses a page, so never a 64K boundary.
+struct prd {
+	uint32_t addr;
+	uint16_t len;
+	uint16_t flags;
+};
+#define PRD_EOT		0x8000
+
+#define PRD_MAX		(256 * SECTSIZE / PGSIZE + 1)
+
+static struct prd prdt[PRD_MAX] __attribute__((aligned(PGSIZE)));
+static int bmbase;		// Bus-master I/O base, 0 if no DMA
+static bool ide_irq;		// IRQ_IDE may be routed to us
+
+// The server's worker envs take turns at the controller.  Each has a
+// private prdt, which it hands the controller for its own transfers.
+static struct mutex ide_lock FS_SHARED;
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,13 +102,125 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
+static uint32_t
+pci_conf_read(int dev, int func, int off)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	return inl(PCI_CONF_DATA);
+}
+
+static void
+pci_conf_write(int dev, int func, int off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	outl(PCI_CONF_DATA, v);
+}
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Find the bus-master IDE controller on PCI bus 0, enable bus
+// mastering and ask the kernel for IRQ_IDE.  Leaves bmbase at 0, so
+// every transfer uses PIO, if there is no such controller.
+void
+ide_dma_init(void)
+{
+	uint32_t class, bar;
+	int dev, func;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			if ((pci_conf_read(dev, func, PCI_ID) & 0xFFFF) == 0xFFFF)
+				continue;
+			class = pci_conf_read(dev, func, PCI_CLASS);
+			// Mass storage / IDE, with bus-master support
+			if ((class >> 16) != 0x0101 || !(class & 0x8000))
+				continue;
+			bar = pci_conf_read(dev, func, PCI_BAR4);
+			if (!(bar & 1) || !(bar & ~3))
+				continue;
+			pci_conf_write(dev, func, PCI_COMMAND,
+				       pci_conf_read(dev, func, PCI_COMMAND) |
+				       PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+			bmbase = bar & ~3;
+			goto found;
+		}
+	return;
+
+found:
+	// Let the drive raise INTRQ (clear nIEN)
+	outb(0x3F6, 0);
+	ide_irq = (sys_irq_listen(IRQ_IDE) == 0);
+	outb(bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);
+}
+
+// Fill prdt for nsecs sectors at va.  Every page must be present, and
+// writable if the device writes it; returns -1 otherwise so the caller
+// uses PIO.
+static int
+ide_dma_setup(void *va, size_t nsecs, bool todev)
+{
+	uintptr_t p = (uintptr_t) va, end = p + nsecs * SECTSIZE;
+	pte_t pte;
+	int n;
+
+	if (p & 3)
+		return -1;
+	for (n = 0; p < end; n++, p = ROUNDDOWN(p, PGSIZE) + PGSIZE) {
+		if (!(uvpd[PDX(p)] & PTE_P))
+			return -1;
+		pte = uvpt[PGNUM(p)];
+		if (!(pte & PTE_P) || (!todev && !(pte & PTE_W)))
+			return -1;
+		prdt[n].addr = PTE_ADDR(pte) + PGOFF(p);
+		prdt[n].len = MIN(end, ROUNDDOWN(p, PGSIZE) + PGSIZE) - p;
+		prdt[n].flags = 0;
+	}
+	prdt[n - 1].flags = PRD_EOT;
+	return 0;
+}
+
+// Transfer nsecs sectors between the disk and va by DMA, sleeping
+// until the controller interrupts.
+static int
+ide_dma(uint32_t secno, void *va, size_t nsecs, bool todev)
 {
+	uint8_t dir = todev ? 0 : BM_CMD_READ, st;
 	int r;
 
-	assert(nsecs <= 256);
+	ide_wait_ready(0);
+
+	// Have the completion interrupt wake this env
+	if (ide_irq)
+		sys_irq_listen(IRQ_IDE);
+
+	outl(bmbase + BM_PRDT, PTE_ADDR(uvpt[PGNUM(prdt)]));
+	outb(bmbase + BM_CMD, dir);
+	outb(bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);
+
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno & 0xFF);
+	outb(0x1F4, (secno >> 8) & 0xFF);
+	outb(0x1F5, (secno >> 16) & 0xFF);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(0x1F7, todev ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+	outb(bmbase + BM_CMD, dir | BM_CMD_START);
+
+	while (!((st = inb(bmbase + BM_STATUS)) & (BM_STATUS_IRQ|BM_STATUS_ERR)))
+		if (ide_irq)
+			sys_irq_wait(IRQ_IDE);
+
+	outb(bmbase + BM_CMD, dir);
+	outb(bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);
+
+	// Reading the status register also acknowledges INTRQ
+	r = inb(0x1F7);
+	if ((st & BM_STATUS_ERR) || (r & (IDE_DF|IDE_ERR)))
+		return -1;
+	return 0;
+}
+
+static int
+ide_pio_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
 
 	ide_wait_ready(0);
 
@@ -85,13 +240,11 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+static int
+ide_pio_write(uint32_t secno, const void *src, size_t nsecs)
 {
 	int r;
 
-	assert(nsecs <= 256);
-
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -110,3 +263,34 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 	return 0;
 }
 
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256);
+
+	mutex_lock(&ide_lock);
+	if (bmbase && nsecs > 0 && ide_dma_setup(dst, nsecs, 0) == 0)
+		r = ide_dma(secno, dst, nsecs, 0);
+	else
+		r = ide_pio_read(secno, dst, nsecs);
+	mutex_unlock(&ide_lock);
+	return r;
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	int r;
+
+	assert(nsecs <= 256);
+
+	mutex_lock(&ide_lock);
+	if (bmbase && nsecs > 0 && ide_dma_setup((void *) src, nsecs, 1) == 0)
+		r = ide_dma(secno, (void *) src, nsecs, 1);
+	else
+		r = ide_pio_write(secno, src, nsecs);
+	mutex_unlock(&ide_lock);
+	return r;
+}
@@ -0,0 +1,75 @@
+/*
+ * Locks for the file server's worker envs.
+ *
+ * The workers (serv.c) run in separate envs, possibly on separate
+ * CPUs, and share only the memory declared FS_SHARED and the regions
+ * shared with sys_region_share, so these locks are plain words in that
+ * memory.  A waiter gives up its CPU with sys_yield rather than spin:
+ * the holder may well be asleep waiting for the disk.
+ */
+
+#include <inc/x86.h>
+
+#include "fs.h"
+
+// Writer holds the lock
+#define RW_WRITER	0x80000000
+// A writer is waiting; keeps new readers out so that it gets a turn
+#define RW_WAITING	0x40000000
+
+void
+mutex_lock(struct mutex *m)
+{
+	while (xchg(&m->locked, 1) != 0)
+		sys_yield();
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	xchg(&m->locked, 0);
+}
+
+void
+rw_rlock(struct rwlock *l)
+{
+	uint32_t s;
+
+	for (;;) {
+		s = l->state;
+		if (!(s & (RW_WRITER | RW_WAITING))
+		    && cmpxchg(&l->state, s, s + 1) == s)
+			return;
+		sys_yield();
+	}
+}
+
+void
+rw_runlock(struct rwlock *l)
+{
+	xadd(&l->state, -1);
+}
+
+void
+rw_wlock(struct rwlock *l)
+{
+	uint32_t s;
+
+	for (;;) {
+		s = l->state;
+		if ((s & ~RW_WAITING) == 0) {
+			if (cmpxchg(&l->state, s, RW_WRITER) == s)
+				return;
+			continue;
+		}
+		if (!(s & RW_WAITING))
+			cmpxchg(&l->state, s, s | RW_WAITING);
+		sys_yield();
+	}
+}
+
+void
+rw_wunlock(struct rwlock *l)
+{
+	xadd(&l->state, -RW_WRITER);
+}
@@ -0,0 +1,198 @@
+/*
+ * Metadata write-ahead log.
+ *
+ * Changes to the bitmap, to struct Files and to directory and pointer
+ * blocks are grouped into transactions.  Before changing such a block,
+ * the file system calls log_write, which adds the block to the running
+ * transaction; the block cache then holds it back (bc_hold), so it
+ * cannot reach its place on disk early.  log_commit writes images of
+ * all of the transaction's blocks to the log area as one sequential
+ * transfer, a header first, and lets the blocks go.  They are written
+ * to their places later, by ordinary write-back: checkpointing is
+ * lazy.  A commit first writes out every other dirty block, which
+ * includes the blocks of the previous transaction, so the log only
+ * ever needs to hold the latest one.  (A block of the previous
+ * transaction that the running one changed again is written from its
+ * image in the staging area instead.)  It also includes file data, so
+ * committed metadata never points to blocks that have not been
+ * written.
+ *
+ * After a crash, log_init copies the latest transaction to its places
+ * again.  A transaction whose write was torn is recognized by its
+ * checksum and dropped: its blocks never left the cache, and the one
+ * before it is already in place.
+ *
+ * Operations that change the file system hold fs_lock for writing and
+ * run in steps that fit in a transaction and leave it consistent
+ * (fs_wlock, fs.c); the log commits only between steps.  So log_commit
+ * must be called with fs_lock held, for reading or writing.
+ */
+
+#include "fs.h"
+
+#define LOG_MAGIC	0x4C4F4721
+
+struct LogHeader {
+	uint32_t lh_magic;		// LOG_MAGIC
+	uint32_t lh_n;			// Blocks in the transaction
+	uint32_t lh_sum;		// Checksum of lh_block and the images
+	uint32_t lh_block[LOG_MAX];	// Where each image belongs
+};
+
+// The log is staged here: header, then images, as on disk.  The pages
+// are shared by the worker envs, and keep the last transaction
+// committed.
+#define LOGSTAGE	((char *) (DISKMAP - 2 * PTSIZE))
+#define loghdr		((struct LogHeader *) LOGSTAGE)
+#define logimage(i)	(LOGSTAGE + (1 + (i)) * BLKSIZE)
+
+// Serializes commits
+static struct mutex log_lock FS_SHARED;
+
+static bool
+log_enabled(void)
+{
+	return super->s_nlog == FS_NLOGBLOCKS;
+}
+
+// FNV-1a, a word at a time, over the staged header's block numbers and
+// the images.
+static uint32_t
+log_checksum(int n)
+{
+	uint32_t h = 2166136261U, *w;
+	int i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ loghdr->lh_block[i]) * 16777619;
+	for (w = (uint32_t *) logimage(0); w < (uint32_t *) logimage(n); w++)
+		h = (h ^ *w) * 16777619;
+	return h;
+}
+
+// Add the block containing addr to the running transaction; call it
+// before changing the block.  The step doing so has reserved room for
+// it (log_reserve).
+void
+log_write(void *addr)
+{
+	if (log_enabled() && bc_hold(addr) < 0)
+		panic("log_write: transaction full at block %08x",
+		      ((uint32_t) addr - DISKMAP) / BLKSIZE);
+}
+
+// Does the running transaction have changes?
+bool
+log_pending(void)
+{
+	return log_space() < LOG_MAX;
+}
+
+// How many more blocks the running transaction can take
+int
+log_space(void)
+{
+	uint32_t blocks[LOG_MAX];
+
+	if (!log_enabled())
+		return LOG_MAX;
+	return LOG_MAX - bc_held_blocks(blocks);
+}
+
+// Make room for n more blocks in the running transaction, committing
+// it if need be.  Called with fs_lock held, between steps.
+void
+log_reserve(int n)
+{
+	if (log_space() < n)
+		log_commit();
+}
+
+// Commit the running transaction, writing out every other dirty block
+// first.  Without a log, just syncs.  Called with fs_lock held.
+void
+log_commit(void)
+{
+	uint32_t held[LOG_MAX];
+	int i, j, n, r;
+
+	mutex_lock(&log_lock);
+	bc_sync();
+	if (!log_enabled() || (n = bc_held_blocks(held)) == 0) {
+		mutex_unlock(&log_lock);
+		return;
+	}
+
+	// bc_sync passed over the held blocks.  Those the previous
+	// transaction changed must be in place before the log forgets it.
+	for (i = 0; i < loghdr->lh_n; i++)
+		for (j = 0; j < n; j++)
+			if (held[j] == loghdr->lh_block[i]
+			    && (r = ide_write(held[j] * BLKSECTS, logimage(i),
+					      BLKSECTS)) < 0)
+				panic("log_commit: ide_write: %i", r);
+
+	memmove(loghdr->lh_block, held, n * sizeof(uint32_t));
+	for (i = 0; i < n; i++)
+		memmove(logimage(i), diskaddr(loghdr->lh_block[i]), BLKSIZE);
+	loghdr->lh_magic = LOG_MAGIC;
+	loghdr->lh_n = n;
+	loghdr->lh_sum = log_checksum(n);
+	if ((r = ide_write(super->s_log * BLKSECTS, LOGSTAGE,
+			   (1 + n) * BLKSECTS)) < 0)
+		panic("log_commit: ide_write: %i", r);
+	bc_release();
+	mutex_unlock(&log_lock);
+}
+
+// Replay the transaction in the log, if a crash left one there, and
+// empty the log.  Called once the super block is in, before anything
+// else on the disk is read.
+void
+log_init(void)
+{
+	uint32_t b;
+	int i, n, r;
+	char *va;
+
+	static_assert(FS_NLOGBLOCKS <= BC_CLUSTER_MAX);
+	static_assert(sizeof(struct LogHeader) <= BLKSIZE);
+
+	if (!log_enabled())
+		return;
+	for (va = LOGSTAGE; va < logimage(LOG_MAX); va += BLKSIZE)
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			panic("log_init: sys_page_alloc: %i", r);
+
+	if ((r = ide_read(super->s_log * BLKSECTS, LOGSTAGE, BLKSECTS)) < 0)
+		panic("log_init: ide_read: %i", r);
+	if ((n = loghdr->lh_n) == 0)
+		return;
+
+	if (loghdr->lh_magic != LOG_MAGIC || n > LOG_MAX)
+		goto drop;
+	for (i = 0; i < n; i++)
+		if ((b = loghdr->lh_block[i]) == 0 || b >= super->s_nblocks)
+			goto drop;
+	if ((r = ide_read((super->s_log + 1) * BLKSECTS, logimage(0),
+			  n * BLKSECTS)) < 0)
+		panic("log_init: ide_read: %i", r);
+	if (log_checksum(n) != loghdr->lh_sum)
+		goto drop;
+
+	// Only the super block is cached yet.  Drop it, so that it is
+	// read again with the changes.
+	for (i = 0; i < n; i++) {
+		b = loghdr->lh_block[i];
+		if ((r = ide_write(b * BLKSECTS, logimage(i), BLKSECTS)) < 0)
+			panic("log_init: ide_write: %i", r);
+		if (va_is_mapped(diskaddr(b)))
+			sys_page_unmap(0, diskaddr(b));
+	}
+	cprintf("log: replayed %d blocks\n", n);
+
+drop:
+	memset(loghdr, 0, BLKSIZE);
+	if ((r = ide_write(super->s_log * BLKSECTS, LOGSTAGE, BLKSECTS)) < 0)
+		panic("log_init: ide_write: %i", r);
+}
@@ -16,37 +16,118 @@
 //
 // 1. The on-disk 'struct File' is mapped into the part of memory
 //    that maps the disk.  This memory is kept private to the file
-//    server.
+//    server and its worker envs (see below).
 // 2. Each open file has a 'struct Fd' as well, which sort of
 //    corresponds to a Unix file descriptor.  This 'struct Fd' is kept
 //    on *its own page* in memory, and it is shared with any
 //    environments that have the file open.
 // 3. 'struct OpenFile' links these other two structures, and is kept
-//    private to the file server.  The server maintains an array of
-//    all open files, indexed by "file ID".  (There can be at most
-//    MAXOPEN files open concurrently.)  The client uses file IDs to
-//    communicate with the server.  File IDs are a lot like
-//    environment IDs in the kernel.  Use openfile_lookup to translate
-//    file IDs to struct OpenFile.
+//    private to the file server and its workers.  The server
+//    maintains an array of all open files, indexed by "file ID".
+//    (There can be at most MAXOPEN files open concurrently.)  The
+//    client uses file IDs to communicate with the server.  File IDs
+//    are a lot like environment IDs in the kernel.  Use
+//    openfile_lookup to translate file IDs to struct OpenFile.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	int o_state;		// OF_FREE, OF_OPENING, OF_OPEN or OF_CLOSED
+	struct mutex o_lock;	// Serializes reads and writes, which move
+				// the shared seek position
 };
 
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
 
-// initialize to force into data section
-struct OpenFile opentab[MAXOPEN] = {
-	{ 0, 0, 1, 0 }
+struct OpenFile opentab[MAXOPEN] FS_SHARED;
+
+// A file is open for as long as some client maps its Fd page, so the
+// page reference count is what decides whether a slot can be reused.
+// To avoid checking every slot on each open, slots are kept on two
+// stacks: those known to be free, and those a client has closed
+// (serve_flush) but may still map.  Clients that exit without closing
+// are only noticed by a sweep of the whole table, which is done when
+// both stacks run dry.  A slot being opened is not mapped by its client
+// until the reply, so the sweep leaves OF_OPENING slots alone.
+enum {
+	OF_FREE = 0,
+	OF_OPENING,
+	OF_OPEN,
+	OF_CLOSED,
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+static uint16_t of_free[MAXOPEN] FS_SHARED;
+static int of_nfree FS_SHARED;
+static uint16_t of_closed[MAXOPEN] FS_SHARED;
+static int of_nclosed FS_SHARED;
+// Protects the stacks and o_state
+static struct mutex opentab_lock FS_SHARED;
+
+// Virtual address at which to receive page mappings containing client
+// requests.  Vectored requests map their data pages right after it.
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - (1 + FSIPC_MAXPAGES) * PGSIZE);
+#define fsreq_data	((char *) fsreq + PGSIZE)
+
+// Pages and permissions of the current request
+static int fsreq_npages, fsreq_perm;
+
+// Worker envs.
+//
+// The file server env itself only dispatches: serve() receives each
+// request, pages and all, and passes it on to one of NWORKER worker
+// envs, which serves it and replies to the client directly.  So a
+// request that has to wait for the disk holds up only its own worker,
+// and on several CPUs independent requests are served in parallel.
+//
+// The workers are forked from the server once the file system is up.
+// They share with it the block cache, the open files' Fd pages and the
+// directory indexes, through page tables shared with
+// sys_region_share, so that a page one of them maps there is mapped in
+// all of them; and the variables declared FS_SHARED (opentab, the
+// dirty list, the dcache and so on), through PTE_SHARE pages.  The
+// rest, such as the stack and the pages a request arrives in, is
+// private to each env.  fs_lock (fs.c) and the locks next to the
+// shared data keep the workers out of each other's way.
+#define NWORKER		4
+
+struct Worker {
+	envid_t w_env;
+	volatile envid_t w_client;	// Client of the request handed over,
+					// until the worker has picked it up
+	volatile bool w_busy;		// Serving a request
+};
+
+static struct Worker workers[NWORKER] FS_SHARED;
+
+// Asynchronous I/O rings (inc/fs.h, lib/fsring.c).  Ring id's ring
+// page and data pages are mapped at ring_page(id), in a region whose
+// page table all the workers share, so any worker can drain any ring.
+// Like an open file, a ring is in use for as long as its client maps
+// the ring page.
+#define NRING		16
+#define RINGVA		(DIRINDEX_VA + DIRINDEX_SIZE)
+#define RING_SPAN	(PTSIZE / NRING)
+
+#define ring_page(id)		((struct Fsring *) (RINGVA + (id) * RING_SPAN))
+#define ring_data(id, slot)	((char *) ring_page(id) + (1 + (slot)) * PGSIZE)
+
+struct Ring {
+	envid_t r_env;			// Client, 0 if never set up
+	uint32_t r_sq_head;		// The server keeps its own indexes,
+	uint32_t r_cq_tail;		// since the client can write the ring
+	volatile uint32_t r_draining;	// A worker is serving the ring
+};
+
+static struct Ring rings[NRING] FS_SHARED;
+// Protects ring setup
+static struct mutex rings_lock FS_SHARED;
+
+// Bounds of the FS_SHARED data, from user/user.ld
+extern char fsshared_start[], fsshared_end[];
 
 void
 serve_init(void)
@@ -58,6 +139,42 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = MAXOPEN - 1; i >= 0; i--)
+		of_free[of_nfree++] = i;
+}
+
+// Move the slots no client maps any more onto the free stack.
+static void
+openfile_reclaim(void)
+{
+	struct OpenFile *o;
+	int i, n;
+
+	for (i = n = 0; i < of_nclosed; i++) {
+		o = &opentab[of_closed[i]];
+		if (o->o_state != OF_CLOSED)
+			continue;
+		if (pageref(o->o_fd) <= 1) {
+			o->o_state = OF_FREE;
+			of_free[of_nfree++] = of_closed[i];
+		} else
+			of_closed[n++] = of_closed[i];
+	}
+	of_nclosed = n;
+	if (of_nfree > 0)
+		return;
+
+	of_nclosed = 0;
+	for (i = 0; i < MAXOPEN; i++) {
+		o = &opentab[i];
+		if (o->o_state == OF_FREE || o->o_state == OF_OPENING)
+			continue;
+		if (pageref(o->o_fd) <= 1) {
+			o->o_state = OF_FREE;
+			of_free[of_nfree++] = i;
+		} else if (o->o_state == OF_CLOSED)
+			of_closed[of_nclosed++] = i;
+	}
 }
 
 // Allocate an open file.
@@ -66,21 +183,52 @@ openfile_alloc(struct OpenFile **o)
 {
 	int i, r;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-		}
+	mutex_lock(&opentab_lock);
+	if (of_nfree == 0)
+		openfile_reclaim();
+	if (of_nfree == 0) {
+		mutex_unlock(&opentab_lock);
+		return -E_MAX_OPEN;
+	}
+
+	i = of_free[of_nfree - 1];
+	if (pageref(opentab[i].o_fd) == 0
+	    && (r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0) {
+		mutex_unlock(&opentab_lock);
+		return r;
+	}
+	of_nfree--;
+	opentab[i].o_state = OF_OPENING;
+	opentab[i].o_fileid += MAXOPEN;
+	mutex_unlock(&opentab_lock);
+	*o = &opentab[i];
+	memset(opentab[i].o_fd, 0, PGSIZE);
+	return (*o)->o_fileid;
+}
+
+// Mark open file o closed, if it is open or being opened, so that
+// openfile_reclaim frees it once no client maps it.
+static void
+openfile_close(struct OpenFile *o)
+{
+	mutex_lock(&opentab_lock);
+	if (o->o_state == OF_OPENING || o->o_state == OF_OPEN) {
+		o->o_state = OF_CLOSED;
+		of_closed[of_nclosed++] = o - opentab;
 	}
-	return -E_MAX_OPEN;
+	mutex_unlock(&opentab_lock);
+}
+
+// The client now maps the Fd page at fd, which serve_open opened.
+static void
+openfile_opened(struct Fd *fd)
+{
+	struct OpenFile *o = &opentab[((uintptr_t) fd - FILEVA) / PGSIZE];
+
+	mutex_lock(&opentab_lock);
+	if (o->o_state == OF_OPENING)
+		o->o_state = OF_OPEN;
+	mutex_unlock(&opentab_lock);
 }
 
 // Look up an open file for envid.
@@ -96,6 +244,75 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Requests that change the file system read what they need from disk
+// first, holding fs_lock only for reading, and then take it for
+// writing.  So readers of cached blocks are not shut out while the
+// disk works.  This is a best effort: a block may be evicted again
+// before the writer gets to it, and then the writer faults it back in.
+
+// Bring in what writing n bytes at offset in f reads.
+static void
+prefetch_write(struct File *f, off_t offset, size_t n)
+{
+	rw_rlock(&fs_lock);
+	file_prefetch(f, offset / BLKSIZE,
+		      (offset % BLKSIZE + n + BLKSIZE - 1) / BLKSIZE);
+	rw_runlock(&fs_lock);
+}
+
+// Bring in what truncating f to newsize reads.
+static void
+prefetch_truncate(struct File *f, off_t newsize)
+{
+	rw_rlock(&fs_lock);
+	if (newsize < f->f_size)
+		file_prefetch_pointers(f);
+	rw_runlock(&fs_lock);
+}
+
+// Bring in path's directories and, if it is about to be truncated or
+// removed, its pointer blocks.
+static void
+prefetch_path(const char *path, bool truncate)
+{
+	struct File *f;
+
+	rw_rlock(&fs_lock);
+	if (file_open(path, &f) == 0 && truncate)
+		file_prefetch_pointers(f);
+	rw_runlock(&fs_lock);
+}
+
+// Open path in mode omode, creating or truncating it as omode says.
+// Holds fs_lock for writing if that changes the file system.
+static int
+open_file(const char *path, int omode, struct File **pf)
+{
+	bool write = omode & (O_CREAT | O_TRUNC);
+	int r;
+
+	if (write) {
+		prefetch_path(path, omode & O_TRUNC);
+		fs_wlock();
+	} else
+		rw_rlock(&fs_lock);
+
+	if (omode & O_CREAT) {
+		r = file_create(path, pf);
+		if (r == -E_FILE_EXISTS && !(omode & O_EXCL))
+			r = file_open(path, pf);
+	} else
+		r = file_open(path, pf);
+	if (r == 0 && (omode & O_TRUNC))
+		r = file_set_size(*pf, 0);
+
+	if (write)
+		rw_wunlock(&fs_lock);
+	else
+		rw_runlock(&fs_lock);
+	return r;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -105,7 +322,6 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 {
 	char path[MAXPATHLEN];
 	struct File *f;
-	int fileid;
 	int r;
 	struct OpenFile *o;
 
@@ -122,37 +338,12 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 			cprintf("openfile_alloc failed: %i", r);
 		return r;
 	}
-	fileid = r;
 
 	// Open the file
-	if (req->req_omode & O_CREAT) {
-		if ((r = file_create(path, &f)) < 0) {
-			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
-				goto try_open;
-			if (debug)
-				cprintf("file_create failed: %i", r);
-			return r;
-		}
-	} else {
-try_open:
-		if ((r = file_open(path, &f)) < 0) {
-			if (debug)
-				cprintf("file_open failed: %i", r);
-			return r;
-		}
-	}
-
-	// Truncate
-	if (req->req_omode & O_TRUNC) {
-		if ((r = file_set_size(f, 0)) < 0) {
-			if (debug)
-				cprintf("file_set_size failed: %i", r);
-			return r;
-		}
-	}
-	if ((r = file_open(path, &f)) < 0) {
+	if ((r = open_file(path, req->req_omode, &f)) < 0) {
 		if (debug)
-			cprintf("file_open failed: %i", r);
+			cprintf("open_file failed: %i", r);
+		openfile_close(o);
 		return r;
 	}
 
@@ -197,7 +388,47 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	prefetch_truncate(o->o_file, req->req_size);
+	fs_wlock();
+	r = file_set_size(o->o_file, req->req_size);
+	rw_wunlock(&fs_lock);
+	return r;
+}
+
+// Read up to n bytes of of into buf at the seek position, and move the
+// seek position past them.  Returns the number of bytes read, < 0 on
+// error.
+static int
+openfile_read(struct OpenFile *of, void *buf, size_t n)
+{
+	int r;
+
+	mutex_lock(&of->o_lock);
+	rw_rlock(&fs_lock);
+	r = file_read(of->o_file, buf, n, of->o_fd->fd_offset);
+	rw_runlock(&fs_lock);
+	if (r > 0)
+		of->o_fd->fd_offset += r;
+	mutex_unlock(&of->o_lock);
+	return r;
+}
+
+// Write n bytes from buf to of at the seek position, like
+// openfile_read.
+static int
+openfile_write(struct OpenFile *of, const void *buf, size_t n)
+{
+	int r;
+
+	mutex_lock(&of->o_lock);
+	prefetch_write(of->o_file, of->o_fd->fd_offset, n);
+	fs_wlock();
+	r = file_write(of->o_file, buf, n, of->o_fd->fd_offset);
+	rw_wunlock(&fs_lock);
+	if (r > 0)
+		of->o_fd->fd_offset += r;
+	mutex_unlock(&of->o_lock);
+	return r;
 }
 
 // Read at most ipc->read.req_n bytes from the current seek position
@@ -219,11 +450,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if (r < 0)
 		return r;
 
-	r = file_read(of->o_file, ret->ret_buf, req->req_n, of->o_fd->fd_offset);
-	if (r > 0){
-		of->o_fd->fd_offset += r;
-	}
-	return r;
+	return openfile_read(of, ret->ret_buf, MIN(req->req_n, PGSIZE));
 }
 
 
@@ -245,12 +472,47 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 		return r;
 	}
 
-	r = file_write(of->o_file, req->req_buf, req->req_n, of->o_fd->fd_offset);
-	if (r >= 0){
-		of->o_fd->fd_offset += r;
-	}
+	return openfile_write(of, req->req_buf, req->req_n);
+}
 
-	return r;
+// Read up to req->req_n bytes from req_fileid, at the current seek
+// position, into the data pages that came with the request.  Returns
+// the number of bytes read, or < 0 on error.
+int
+serve_readv(envid_t envid, struct Fsreq_readv *req)
+{
+	struct OpenFile *of;
+	int r;
+
+	if (debug)
+		cprintf("serve_readv %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &of)) < 0)
+		return r;
+	if (!(fsreq_perm & PTE_W)
+	    || req->req_n > (fsreq_npages - 1) * PGSIZE)
+		return -E_INVAL;
+
+	return openfile_read(of, fsreq_data, req->req_n);
+}
+
+// Write req->req_n bytes from the data pages that came with the
+// request, like serve_write.
+int
+serve_writev(envid_t envid, struct Fsreq_writev *req)
+{
+	struct OpenFile *of;
+	int r;
+
+	if (debug)
+		cprintf("serve_writev %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &of)) < 0)
+		return r;
+	if (req->req_n > (fsreq_npages - 1) * PGSIZE)
+		return -E_INVAL;
+
+	return openfile_write(of, fsreq_data, req->req_n);
 }
 
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
@@ -269,13 +531,16 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
+	rw_rlock(&fs_lock);
 	strcpy(ret->ret_name, o->o_file->f_name);
 	ret->ret_size = o->o_file->f_size;
 	ret->ret_isdir = (o->o_file->f_type == FTYPE_DIR);
+	rw_runlock(&fs_lock);
 	return 0;
 }
 
-// Flush all data and metadata of req->req_fileid to disk.
+// Flush all data and metadata of req->req_fileid to disk, and mark it
+// closed if req->req_close.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
 {
@@ -287,15 +552,186 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
+	// Writing blocks out changes nothing that readers look at
+	rw_rlock(&fs_lock);
 	file_flush(o->o_file);
+	rw_runlock(&fs_lock);
+
+	// Clients flush on fsync too, which leaves the file open.  A
+	// closed slot is free only once the last client unmaps the Fd
+	// page.
+	if (req->req_close)
+		openfile_close(o);
 	return 0;
 }
 
+// Remove the file req->req_path.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+	int r;
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	prefetch_path(path, 1);
+	fs_wlock();
+	r = file_remove(path);
+	rw_wunlock(&fs_lock);
+	return r;
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
+	rw_rlock(&fs_lock);
 	fs_sync();
+	rw_runlock(&fs_lock);
+	return 0;
+}
+
+// Set up a ring for envid from the ring page and data pages that came
+// with the request.  Returns the ring's id, < 0 on error.
+int
+serve_ring_setup(envid_t envid, union Fsipc *ipc)
+{
+	int id, i, r;
+
+	static_assert(FSRING_NSLOTS <= FSIPC_MAXPAGES);
+	static_assert((1 + FSRING_NSLOTS) * PGSIZE <= RING_SPAN);
+
+	if (debug)
+		cprintf("serve_ring_setup %08x\n", envid);
+
+	if (!(fsreq_perm & PTE_W) || fsreq_npages != 1 + FSRING_NSLOTS)
+		return -E_INVAL;
+
+	mutex_lock(&rings_lock);
+	for (id = 0; id < NRING; id++)
+		if (!rings[id].r_env || pageref(ring_page(id)) <= 1)
+			break;
+	if (id == NRING) {
+		mutex_unlock(&rings_lock);
+		return -E_MAX_OPEN;
+	}
+
+	// Mapping the new pages drops the previous client's
+	rings[id].r_env = 0;
+	for (i = 0; i < 1 + FSRING_NSLOTS; i++)
+		if ((r = sys_page_map(0, (char *) fsreq + i * PGSIZE,
+				      0, (char *) ring_page(id) + i * PGSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0) {
+			mutex_unlock(&rings_lock);
+			return r;
+		}
+	rings[id].r_sq_head = rings[id].r_cq_tail = 0;
+	rings[id].r_draining = 0;
+	ring_page(id)->r_id = id;
+	rings[id].r_env = envid;
+	mutex_unlock(&rings_lock);
+	return id;
+}
+
+// Carry out the ring request sqe on ring id.  Reads and writes are at
+// the request's file offset and leave the seek position alone.
+// Returns the number of bytes read or written, < 0 on error.
+static int
+ring_serve_one(envid_t envid, int id, const struct Fsring_sqe *sqe)
+{
+	struct OpenFile *of;
+	char *data;
+	int r;
+
+	if (sqe->sqe_slot >= FSRING_NSLOTS || sqe->sqe_n > PGSIZE
+	    || sqe->sqe_offset < 0)
+		return -E_INVAL;
+	if ((r = openfile_lookup(envid, sqe->sqe_fileid, &of)) < 0)
+		return r;
+	data = ring_data(id, sqe->sqe_slot);
+
+	switch (sqe->sqe_op) {
+	case FSRING_READ:
+		rw_rlock(&fs_lock);
+		r = file_read(of->o_file, data, sqe->sqe_n, sqe->sqe_offset);
+		rw_runlock(&fs_lock);
+		return r;
+	case FSRING_WRITE:
+		prefetch_write(of->o_file, sqe->sqe_offset, sqe->sqe_n);
+		fs_wlock();
+		r = file_write(of->o_file, data, sqe->sqe_n, sqe->sqe_offset);
+		rw_wunlock(&fs_lock);
+		return r;
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Does the client have requests on ring for the server?  A client
+// never has more than FSRING_NSLOTS requests in flight; more means its
+// ring page is garbage, which is ignored.
+static bool
+ring_pending(struct Ring *ring, struct Fsring *fr)
+{
+	uint32_t n = fr->r_sq_tail - ring->r_sq_head;
+
+	return n > 0 && n <= FSRING_NSLOTS;
+}
+
+// The doorbell of the ring whose page came with the request: serve the
+// requests submitted on it, in order, posting a completion for each.
+// Only one worker serves a ring at a time.  A doorbell that finds one
+// at it returns at once, and that worker looks for more requests after
+// letting go.  The client does not wait for a reply.
+int
+serve_ring_enter(envid_t envid, union Fsipc *ipc)
+{
+	uint32_t id = ((struct Fsring *) ipc)->r_id;
+	struct Fsring_sqe sqe;
+	struct Fsring_cqe *cqe;
+	struct Ring *ring;
+	struct Fsring *fr;
+
+	if (debug)
+		cprintf("serve_ring_enter %08x %u\n", envid, id);
+
+	if (id >= NRING || rings[id].r_env != envid)
+		return -E_INVAL;
+	ring = &rings[id];
+	fr = ring_page(id);
+
+	while (ring_pending(ring, fr) && xchg(&ring->r_draining, 1) == 0) {
+		while (ring_pending(ring, fr)) {
+			barrier();
+			sqe = fr->r_sq[ring->r_sq_head++ % FSRING_NSLOTS];
+			cqe = &fr->r_cq[ring->r_cq_tail++ % FSRING_NSLOTS];
+			cqe->cqe_slot = sqe.sqe_slot;
+			cqe->cqe_res = ring_serve_one(envid, id, &sqe);
+			barrier();
+			fr->r_cq_tail = ring->r_cq_tail;
+		}
+		xchg(&ring->r_draining, 0);
+	}
+	return 0;
+}
+
+// Set the block cache's limit to ipc->cachestat.req_limit blocks,
+// unless that is 0, and return the cache counters in
+// ipc->cachestatRet.
+int
+serve_cachestat(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_cachestat %08x %u\n", envid,
+			ipc->cachestat.req_limit);
+
+	if (ipc->cachestat.req_limit)
+		bc_set_limit(ipc->cachestat.req_limit);
+	bc_get_stats(&ipc->cachestatRet);
 	return 0;
 }
 
@@ -309,23 +745,184 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_READV] =		(fshandler)serve_readv,
+	[FSREQ_WRITEV] =	(fshandler)serve_writev,
+	[FSREQ_CACHESTAT] =	serve_cachestat,
+	[FSREQ_RING_SETUP] =	serve_ring_setup,
+	[FSREQ_RING_ENTER] =	serve_ring_enter
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Serve request req from whom, which came in the pages at fsreq, and
+// reply to whom.
+static void
+serve_request(envid_t whom, uint32_t req)
+{
+	int perm = fsreq_perm, r, i;
+	void *pg = NULL;
+
+	if (debug)
+		cprintf("fs req %d from %08x [page %08x: %s]\n",
+			req, whom, uvpt[PGNUM(fsreq)], (char *) fsreq);
+
+	if (req == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+	} else if (req < NHANDLERS && handlers[req]) {
+		r = handlers[req](whom, fsreq);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+	}
+	// Doorbells are one-way
+	if (req != FSREQ_RING_ENTER)
+		ipc_send(whom, r, pg, perm);
+	if (req == FSREQ_OPEN && r == 0)
+		openfile_opened(pg);
+	for (i = 0; i < fsreq_npages; i++)
+		sys_page_unmap(0, (char *) fsreq + i * PGSIZE);
+	fs_writeback();
+}
+
+// A worker env's main loop: take requests from the server and serve
+// them.
+static void __attribute__((noreturn))
+worker(struct Worker *w)
+{
+	envid_t from, whom;
+	uint32_t req;
+	int i;
+
+	while (1) {
+		w->w_busy = 0;
+		fsreq_perm = 0;
+		fsreq_npages = 1 + FSIPC_MAXPAGES;
+		req = ipc_recv_pages(&from, fsreq, &fsreq_npages, &fsreq_perm);
+		if (from != thisenv->env_parent_id) {
+			for (i = 0; i < fsreq_npages; i++)
+				sys_page_unmap(0, (char *) fsreq + i * PGSIZE);
+			continue;
+		}
+		whom = w->w_client;
+		w->w_client = 0;
+		serve_request(whom, req);
+	}
+}
+
+// Fork a worker env, like dumbfork: the private parts of the address
+// space are copied right away, since the server's page fault handler
+// is the block cache's, not fork's copy-on-write one.  Read-only pages
+// and the FS_SHARED pages are mapped, and the block cache, Fd page,
+// directory index and ring regions are shared.  Returns like fork.
+static envid_t
+worker_fork(void)
+{
+	uintptr_t va;
+	envid_t envid;
+	pte_t pte;
+	int r;
+
+	if ((envid = sys_exofork()) < 0)
+		return envid;
+	if (envid == 0) {
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+
+	if ((r = sys_region_share(envid, (void *) DISKMAP,
+				  ROUNDUP(super->s_nblocks * BLKSIZE, PTSIZE))) < 0
+	    || (r = sys_region_share(envid, (void *) FILEVA,
+				     ROUNDUP(MAXOPEN * PGSIZE, PTSIZE))) < 0
+	    || (r = sys_region_share(envid, (void *) DIRINDEX_VA,
+				     DIRINDEX_SIZE)) < 0
+	    || (r = sys_region_share(envid, (void *) RINGVA, PTSIZE)) < 0)
+		goto fail;
+
+	for (va = 0; va < USTACKTOP; va += PGSIZE) {
+		if (va == DISKMAP)
+			va = RINGVA + PTSIZE;
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		if (!((pte = uvpt[PGNUM(va)]) & PTE_P))
+			continue;
+		if ((pte & PTE_SHARE) || !(pte & PTE_W))
+			r = sys_page_map(0, (void *) va, envid, (void *) va,
+					 pte & PTE_SYSCALL);
+		else if ((r = sys_page_alloc(envid, (void *) va, PTE_P|PTE_U|PTE_W)) == 0
+			 && (r = sys_page_map(envid, (void *) va, 0, UTEMP,
+					      PTE_P|PTE_U|PTE_W)) == 0) {
+			memmove(UTEMP, (void *) va, PGSIZE);
+			r = sys_page_unmap(0, UTEMP);
+		}
+		if (r < 0)
+			goto fail;
+	}
+
+	if ((r = sys_page_alloc(envid, (void *) (UXSTACKTOP - PGSIZE),
+				PTE_P|PTE_U|PTE_W)) < 0
+	    || (r = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)) < 0
+	    || (r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		goto fail;
+	return envid;
+
+fail:
+	sys_env_destroy(envid);
+	return r;
+}
+
+// Share the FS_SHARED pages with the workers and start them.
+static void
+serve_start_workers(void)
+{
+	uintptr_t va;
+	envid_t envid;
+	int i, r;
+
+	for (va = (uintptr_t) fsshared_start; va < (uintptr_t) fsshared_end; va += PGSIZE)
+		if ((r = sys_page_map(0, (void *) va, 0, (void *) va,
+				      PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			panic("serve_start_workers: sys_page_map: %i", r);
+
+	for (i = 0; i < NWORKER; i++) {
+		if ((envid = worker_fork()) < 0)
+			panic("serve_start_workers: worker_fork: %i", envid);
+		if (envid == 0)
+			worker(&workers[i]);
+		workers[i].w_env = envid;
+	}
+}
+
+// Wait for a worker to be idle, and return it.  A request is never
+// committed to a busy worker, where it would queue behind a slow
+// request while the other workers finish and have nothing to do.
+static struct Worker *
+idle_worker(void)
+{
+	int i;
+
+	while (1) {
+		for (i = 0; i < NWORKER; i++)
+			if (!workers[i].w_busy)
+				return &workers[i];
+		sys_yield();
+	}
+}
+
+// Hand each request to the first worker that is idle.
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int npages, perm, i;
+	struct Worker *w;
 
 	while (1) {
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
-		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], (char *) fsreq);
+		npages = 1 + FSIPC_MAXPAGES;
+		req = ipc_recv_pages((int32_t *) &whom, fsreq, &npages, &perm);
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -334,20 +931,16 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		// An idle worker has picked up the last request handed to
+		// it, so w_client is free
+		w = idle_worker();
+		w->w_client = whom;
+		w->w_busy = 1;
+		ipc_send_pages(w->w_env, req, fsreq, npages, perm);
+		for (i = 0; i < npages; i++)
+			sys_page_unmap(0, (char *) fsreq + i * PGSIZE);
 	}
 }
-
 void
 umain(int argc, char **argv)
 {
@@ -362,6 +955,7 @@ umain(int argc, char **argv)
 	serve_init();
 	fs_init();
         fs_test();
+	serve_start_workers();
 	serve();
 }
 
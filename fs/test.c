@@ -49,19 +49,21 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %i", r);
-	assert(f->f_direct[0] == 0);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(f->f_extent[0].e_len == 0);
+	// The change waits in the metadata log until a flush commits it
+	assert(!super->s_nlog || log_pending());
+	file_flush(f);
+	assert(!log_pending());
 	//cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %i", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %i", r);
 	strcpy(blk, msg);
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(!log_pending());
 	//cprintf("file rewrite is good\n");
 }
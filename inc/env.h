@@ -30,6 +30,9 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Most pages one IPC can map (sys_ipc_try_send, sys_ipc_recv)
+#define IPC_MAXPAGES		64
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -56,6 +59,12 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_cpumask;		// CPUs the env may run on (0 = any)
+	int env_rq_cpu;			// Run queue holding the env, or -1
+	struct Env *env_rq_next;	// Links in that run queue
+	struct Env *env_rq_prev;
+	bool env_oncpu;			// Some CPU's curenv, which requeues it
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
 	// Exception handling
@@ -67,6 +76,11 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	int env_ipc_npages;		// Pages wanted at dstva, then received
+
+	// Device interrupts routed to this env (sys_irq_listen)
+	uint16_t env_irq_pending;	// IRQs raised but not yet waited for
+	uint16_t env_irq_waiting;	// IRQs the env is blocked on
 
 	//Itask clock
 	int64_t env_cputime;
@@ -21,6 +21,7 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	int (*dev_sync)(struct Fd *fd);
 };
 
 struct FdFile {
@@ -50,6 +51,13 @@ int	fd_alloc(struct Fd **fd_store);
 int	fd_close(struct Fd *fd, bool must_exist);
 int	fd_lookup(int fdnum, struct Fd **fd_store);
 int	dev_lookup(int devid, struct Dev **dev_store);
+void	fdbuf_flush_all(void);
+
+// lib/fdbuf.c
+int	fdbuf_enable(struct Fd *fd);
+int	fdbuf_flush(struct Fd *fd);
+ssize_t	fdbuf_read(struct Fd *fd, struct Dev *dev, void *buf, size_t n);
+ssize_t	fdbuf_write(struct Fd *fd, struct Dev *dev, const void *buf, size_t n);
 
 extern struct Dev devfile;
 extern struct Dev devcons;
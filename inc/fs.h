@@ -19,26 +19,46 @@
 // Maximum size of a complete pathname, including null
 #define MAXPATHLEN	1024
 
-// Number of block pointers in a File descriptor
-#define NDIRECT		10
-// Number of direct block pointers in an indirect block
+// A file's blocks are mapped by a list of extents, each a run of
+// consecutive disk blocks; together they map file blocks 0, 1, ...
+// in order.  Files written sequentially on a disk with free space
+// need nothing more.  Once a block cannot be added to the extents
+// (the list is full, or it is not the next block of the file), the
+// extents are frozen and every later block goes through block
+// pointers instead: an indirect block for file blocks below
+// NINDIRECT and a double-indirect block above that.  The pointer
+// tree is indexed by file block number; entries for blocks the
+// extents cover stay unused.
+
+// Number of extents in a File descriptor
+#define NEXTENT		12
+// Number of block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Largest file the block pointers could map, in blocks
+#define MAXFILEBLOCKS	(NINDIRECT + NINDIRECT * NINDIRECT)
+// off_t is signed 32 bits, which limits files before MAXFILEBLOCKS does
+#define MAXFILESIZE	((off_t) 0x7FFFF000)
+
+struct Extent {
+	uint32_t e_start;		// first disk block
+	uint32_t e_len;			// number of blocks, 0 if unused
+} __attribute__((packed));
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
+	// Block map.  A block is allocated iff its pointer is != 0;
+	// extents never map holes.
+	struct Extent f_extent[NEXTENT];	// extents, from file block 0 up
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// double-indirect block
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 8*NEXTENT - 8];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -57,6 +77,58 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_log;			// First block of the metadata log
+	uint32_t s_nlog;		// Blocks in the log, 0 if there is none
+};
+
+// Blocks fsformat sets aside for the metadata log (fs/log.c), right
+// after the bitmap
+#define FS_NLOGBLOCKS	32
+
+// Block cache counters, returned by FSREQ_CACHESTAT
+struct Fscachestat {
+	uint32_t cs_hits;		// Block lookups that found the block cached
+	uint32_t cs_misses;		// ... and that had to go to the disk
+	uint32_t cs_reads;		// Blocks read in, counting read-ahead
+	uint32_t cs_evictions;		// Blocks dropped to make room
+	uint32_t cs_dirty_evictions;	// ... that had to be written out first
+	uint32_t cs_nblocks;		// Blocks cached now
+	uint32_t cs_limit;		// Most blocks cached at once
+};
+
+// Most data pages one FSREQ_READV or FSREQ_WRITEV request carries
+#define FSIPC_MAXPAGES	32
+
+// Asynchronous I/O rings (lib/fsring.c).  A client shares a ring page
+// and FSRING_NSLOTS data pages with the file server.  Each request in
+// flight owns one data page, so neither queue can overflow.  The
+// indexes run freely and are taken modulo FSRING_NSLOTS.
+#define FSRING_NSLOTS	32
+
+enum {
+	FSRING_READ = 1,
+	FSRING_WRITE
+};
+
+struct Fsring_sqe {
+	uint32_t sqe_op;	// FSRING_READ or FSRING_WRITE
+	uint32_t sqe_fileid;
+	uint32_t sqe_slot;	// Data page to read into or write from
+	uint32_t sqe_n;		// Bytes, at most PGSIZE
+	off_t sqe_offset;	// File offset; the seek position is unused
+};
+
+struct Fsring_cqe {
+	uint32_t cqe_slot;	// Slot of the request completed
+	int32_t cqe_res;	// Bytes read or written, or < 0 on error
+};
+
+struct Fsring {
+	uint32_t r_id;			// Set by the server
+	volatile uint32_t r_sq_tail;	// Next submission the client fills
+	volatile uint32_t r_cq_tail;	// Next completion the server posts
+	struct Fsring_sqe r_sq[FSRING_NSLOTS];
+	struct Fsring_cqe r_cq[FSRING_NSLOTS];
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +142,18 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Vectored read and write: the request page is followed by up to
+	// FSIPC_MAXPAGES pages of data, all sent in one IPC
+	FSREQ_READV,
+	FSREQ_WRITEV,
+	// Cache stats return a Fscachestat on the request page
+	FSREQ_CACHESTAT,
+	// Ring setup sends the ring page and its FSRING_NSLOTS data pages
+	// and returns the ring's id
+	FSREQ_RING_SETUP,
+	// The ring doorbell sends the ring page and gets no reply
+	FSREQ_RING_ENTER
 };
 
 union Fsipc {
@@ -104,10 +187,23 @@ union Fsipc {
 	} statRet;
 	struct Fsreq_flush {
 		int req_fileid;
+		bool req_close;		// The client is closing the file
 	} flush;
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_readv {
+		int req_fileid;
+		size_t req_n;
+	} readv;
+	struct Fsreq_writev {
+		int req_fileid;
+		size_t req_n;
+	} writev;
+	struct Fsreq_cachestat {
+		uint32_t req_limit;	// If not 0, the new cache limit
+	} cachestat;
+	struct Fscachestat cachestatRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
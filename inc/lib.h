@@ -54,12 +54,18 @@ static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_cpumask(envid_t env, uint32_t mask);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg, int npages, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_pages(void *rcv_pg, int npages);
+int	sys_irq_listen(int irq);
+int	sys_irq_wait(int irq);
+int	sys_region_share(envid_t envid, void *va, size_t size);
 int sys_gettime(void);
 int sys_clock_getres(int clock_id, struct timespec *res);
 int sys_clock_gettime(int clock_id, struct timespec *tp);
@@ -67,6 +73,8 @@ int sys_clock_settime(int clock_id, const struct timespec *tp);
 int sys_clock_nanosleep(int clock_id, int flags, const struct timespec *rqtp, struct timespec *rmtp);
 
 int vsys_gettime(void);
+int vsys_clock_gettime(int clock_id, struct timespec *tp);
+int elapsed_ms(const struct timespec *start);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -84,6 +92,8 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, int npages, int perm);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, int *npages, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
@@ -96,6 +106,7 @@ int	close(int fd);
 ssize_t	read(int fd, void *buf, size_t nbytes);
 ssize_t	write(int fd, const void *buf, size_t nbytes);
 int	seek(int fd, off_t offset);
+int	fsync(int fd);
 void	close_all(void);
 ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
@@ -107,6 +118,13 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fscachestat(uint32_t limit, struct Fscachestat *st);
+
+// fsring.c
+int	fsring_read(int fd, void *buf, size_t n, off_t offset);
+int	fsring_write(int fd, const void *buf, size_t n, off_t offset);
+void	fsring_submit(void);
+int	fsring_wait(int *tag_store);
 
 // pageref.c
 int	pageref(void *addr);
@@ -139,6 +157,7 @@ void	wait(envid_t env);
 #define	O_TRUNC		0x0200		/* truncate to zero length */
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
+#define O_BUFFERED	0x1000		/* buffer reads and writes (lib/fdbuf.c) */
 
 #ifdef JOS_PROG
 extern void (* volatile sys_exit)(void);
@@ -96,6 +96,9 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// Physical address of startup code for non-boot CPUs (APs)
+#define MPENTRY_PADDR	0x7000
+
 // Kernel stack.
 #define KSTACKTOP	KERNTOP
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
@@ -22,6 +22,10 @@ enum {
 	SYS_clock_gettime,
 	SYS_clock_settime,
 	SYS_clock_nanosleep,
+	SYS_env_set_cpumask,
+	SYS_irq_listen,
+	SYS_irq_wait,
+	SYS_region_share,
 	NSYSCALLS
 };
 
@@ -1,10 +1,13 @@
 
+#include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/assert.h>
 
 #ifndef JOS_INC_TIME_H
 #define JOS_INC_TIME_H
 
+#define NSEC_PER_SEC 1000000000ULL
+
 struct tm
 {
     int tm_sec;                   /* Seconds.     [0-60] */
@@ -48,4 +51,43 @@ struct timespec sub_timespec(const struct timespec *tm1, const struct timespec *
 
 int clock_nanosleep(int clock_id, int flags, const struct timespec *rqtp, struct timespec *rmtp);
 
+// (a * mul) >> shift for shift <= 32, keeping all 96 bits of the
+// product.  This and the helpers below only multiply, so they do not
+// pull in libgcc's 64-bit division.
+static inline uint64_t
+mul_u64_u32_shr(uint64_t a, uint32_t mul, unsigned shift)
+{
+	uint64_t ret;
+
+	ret = ((uint64_t) (uint32_t) a * mul) >> shift;
+	if (a >> 32)
+		ret += ((uint64_t) (uint32_t) (a >> 32) * mul) << (32 - shift);
+	return ret;
+}
+
+static inline int64_t
+timespec_to_ns(const struct timespec *tp)
+{
+	return (int64_t) tp->tv_sec * NSEC_PER_SEC + tp->tv_nsec;
+}
+
+static inline struct timespec
+ns_to_timespec(uint64_t ns)
+{
+	struct timespec tp;
+	uint64_t sec;
+
+	// sec = ns / 10^9 = (ns / 2^9) / 1953125, using the reciprocal
+	// 2^52 / 1953125.  It rounds down, so fix it up.
+	sec = mul_u64_u32_shr(ns >> 9, 2305843009U, 32) >> 20;
+	ns -= sec * NSEC_PER_SEC;
+	while (ns >= NSEC_PER_SEC) {
+		ns -= NSEC_PER_SEC;
+		sec++;
+	}
+	tp.tv_sec = sec;
+	tp.tv_nsec = ns;
+	return tp;
+}
+
 #endif
@@ -4,6 +4,18 @@
 /* system call numbers */
 enum {
 	VSYS_gettime,
+	// Clock parameters for vsys_clock_gettime(), written by
+	// clock_publish() in kern/tsc.c.  The generation is odd while
+	// they change; readers retry until they see the same even
+	// generation before and after reading them.
+	VSYS_clock_gen,
+	VSYS_cpu_freq,		// TSC frequency in kHz
+	VSYS_tsc_mult,		// ns = (TSC cycles * mult) >> shift
+	VSYS_tsc_shift,
+	VSYS_mono_start_lo,	// TSC at CLOCK_MONOTONIC zero
+	VSYS_mono_start_hi,
+	VSYS_realtime_sec,	// CLOCK_REALTIME at mono_start
+	VSYS_realtime_nsec,
 	NVSYSCALLS
 };
 
@@ -28,12 +28,24 @@ static __inline uint32_t rcr3(void) __attribute__((always_inline));
 static __inline void lcr4(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr4(void) __attribute__((always_inline));
 static __inline void tlbflush(void) __attribute__((always_inline));
+static __inline void clts(void) __attribute__((always_inline));
 static __inline uint32_t read_eflags(void) __attribute__((always_inline));
 static __inline void write_eflags(uint32_t eflags) __attribute__((always_inline));
 static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+
+// Model-specific registers
+#define MSR_IA32_SYSENTER_CS	0x174
+#define MSR_IA32_SYSENTER_ESP	0x175
+#define MSR_IA32_SYSENTER_EIP	0x176
+
+// CPUID.1:EDX feature bits
+#define CPUID_FEAT_SEP		(1 << 11)	// SYSENTER/SYSEXIT
+#define CPUID_FEAT_SSE2		(1 << 26)
 
 static __inline void
 breakpoint(void)
@@ -225,6 +237,12 @@ tlbflush(void)
 	__asm __volatile("movl %0,%%cr3" : : "r" (cr3));
 }
 
+static __inline void
+clts(void)
+{
+	__asm __volatile("clts");
+}
+
 static __inline uint32_t
 read_eflags(void)
 {
@@ -280,6 +298,20 @@ read_tsc(void)
 	return tsc;
 }
 
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static __inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -293,6 +325,49 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically add v to *addr and return the old value.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t v)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (v), "+m" (*addr) :
+			:
+			"cc", "memory");
+	return v;
+}
+
+// Atomically set *addr to newval if it equals old; return the old value.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t old, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (old) :
+			"cc", "memory");
+	return result;
+}
+
+// Keep the compiler from moving memory accesses across this point.
+// x86 does not reorder stores with stores or loads with loads, so this
+// is all it takes to publish data through shared memory in order.
+static inline void
+barrier(void)
+{
+	asm volatile("" : : : "memory");
+}
+
+// Index of the lowest set bit of v, which must not be 0.
+static inline uint32_t
+bsf(uint32_t v)
+{
+	uint32_t r;
+
+	asm("bsfl %1, %0" : "=r" (r) : "rm" (v) : "cc");
+	return r;
+}
+
 #define NMI_LOCK	0x80
 
 static inline void
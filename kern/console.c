@@ -8,10 +8,38 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Serializes console output and the input buffer between CPUs.
+// The holder may re-enter the console (kbd_proc_data prints on
+// reboot, panic prints from anywhere), so the lock nests per CPU.
+static struct spinlock console_lock = SPINLOCK_INIT(console_lock, LOCK_CONSOLE);
+static volatile int console_cpu = -1;
+static int console_depth;
+
+void
+cons_lock(void)
+{
+	if (console_cpu != cpunum()) {
+		spin_lock(&console_lock);
+		console_cpu = cpunum();
+	}
+	console_depth++;
+}
+
+void
+cons_unlock(void)
+{
+	if (--console_depth == 0) {
+		console_cpu = -1;
+		spin_unlock(&console_lock);
+	}
+}
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -59,8 +87,11 @@ serial_proc_data(void)
 void
 serial_intr(void)
 {
-	if (serial_exists)
+	if (serial_exists) {
+		cons_lock();
 		cons_intr(serial_proc_data);
+		cons_unlock();
+	}
 }
 
 static void
@@ -367,7 +398,9 @@ kbd_proc_data(void)
 void
 kbd_intr(void)
 {
+	cons_lock();
 	cons_intr(kbd_proc_data);
+	cons_unlock();
 }
 
 static void
@@ -413,7 +446,9 @@ cons_intr(int (*proc)(void))
 int
 cons_getc(void)
 {
-	int c;
+	int c = 0;
+
+	cons_lock();
 
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
@@ -426,9 +461,9 @@ cons_getc(void)
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	cons_unlock();
+	return c;
 }
 
 // output a character to the console
@@ -458,7 +493,9 @@ cons_init(void)
 void
 cputchar(int c)
 {
+	cons_lock();
 	cons_putc(c);
+	cons_unlock();
 }
 
 int
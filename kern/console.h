@@ -19,6 +19,8 @@
 
 void cons_init(void);
 int cons_getc(void);
+void cons_lock(void);
+void cons_unlock(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
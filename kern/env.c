@@ -14,17 +14,19 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/kdebug.h>
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
 
 #ifdef CONFIG_KSPACE
 struct Env env_array[NENV];
-struct Env *curenv = NULL;
 struct Env *envs = env_array;		// All environments
 #else
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;		// The current env
 #endif
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
+static struct spinlock env_alloc_lock = SPINLOCK_INIT(env_alloc_lock, LOCK_ENV_ALLOC);
+static struct spinlock env_locks[NENV];	// Per-env locks, see env_lock()
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
@@ -119,6 +121,71 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Like envid2env, but returns with the environment locked.
+// Fails if the environment was freed before we got the lock.
+int
+envid2env_locked(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+	env_lock(e);
+	if (!env_alive(e, envid)) {
+		env_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
+// Is e (looked up as envid) still that environment?  Call with e locked.
+bool
+env_alive(struct Env *e, envid_t envid)
+{
+	return e->env_status != ENV_FREE && (!envid || e->env_id == envid);
+}
+
+// Each Env has a lock covering its status, page directory contents,
+// IPC fields and scheduling fields.  See kern/spinlock.h for the
+// order in which it may be combined with other locks.
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+// Lock two environments, lower ENVX first.  a and b may be the same.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b) {
+		env_lock(a);
+	} else if (a < b) {
+		env_lock(a);
+		env_lock(b);
+	} else {
+		env_lock(b);
+		env_lock(a);
+	}
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (a != b)
+		env_unlock(b);
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -132,13 +199,18 @@ env_init(void)
 	// LAB 3: Your code here.
 	env_free_list = envs;
 	int i;
+	for(i = 0; i < NENV; i++){
+		spin_initlock(&env_locks[i], LOCK_ENV);
+	}
 	for(i = 0; i < NENV - 1; i++){
 		memset(&envs[i], 0, sizeof(envs[i]));
 		envs[i].env_link = envs + i + 1;
 		envs[i].env_status = ENV_FREE;
+		envs[i].env_rq_cpu = -1;
 	}
 	memset(&envs[NENV - 1], 0, sizeof(envs[NENV - 1]));
 	envs[NENV - 1].env_status = ENV_FREE;
+	envs[NENV - 1].env_rq_cpu = -1;
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
@@ -226,12 +298,16 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	int r;
 	struct Env *e;
 
+	spin_lock(&env_alloc_lock);
 	if (!(e = env_free_list)) {
+		spin_unlock(&env_alloc_lock);
 		return -E_NO_FREE_ENV;
 	}
 	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	if ((r = env_setup_vm(e)) < 0) {
+		spin_unlock(&env_alloc_lock);
 		return r;
+	}
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
 	if (generation <= 0)	// Don't create a negative env_id.
@@ -248,6 +324,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
 	e->env_cputime = 0;
+	e->env_cpumask = 0;
+	e->env_oncpu = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -289,9 +367,12 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_irq_pending = 0;
+	e->env_irq_waiting = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
+	spin_unlock(&env_alloc_lock);
 	*newenv_store = e;
 
 	//cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -301,12 +382,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
-// Does not zero or otherwise initialize the mapped pages in any way.
+// Does not initialize the mapped pages, except as alloc_flags asks
+// page_alloc() to.
 // Pages should be writable by user and kernel.
 // Panic if any allocation attempt fails.
 //
 static void
-region_alloc(struct Env *e, void *va, size_t len)
+region_alloc(struct Env *e, void *va, size_t len, int alloc_flags)
 {
 	// LAB 3: Your code here.
 	// (But only if you need it for load_icode.)
@@ -315,10 +397,16 @@ region_alloc(struct Env *e, void *va, size_t len)
 	//   'va' and 'len' values that are not page-aligned.
 	//   You should round va down, and round (va + len) up.
 	//   (Watch out for corner-cases!)
+	// Pages are allocated with alloc_flags, and a page already mapped
+	// by an earlier segment is kept.
 	uintptr_t addr = ROUNDDOWN((uintptr_t)va, PGSIZE);
 	uintptr_t end = ROUNDUP((uintptr_t)va + len, PGSIZE);
 	while (addr < end) {
-        struct PageInfo *page = page_alloc(0);
+        if (page_lookup(e->env_pgdir, (void *)addr, NULL)) {
+            addr += PGSIZE;
+            continue;
+        }
+        struct PageInfo *page = page_alloc(alloc_flags);
         if (page == NULL){
             panic("region_alloc: not enough memory for page_alloc");
 		}
@@ -419,6 +507,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	//  What?  (See env_run() and env_pop_tf() below.)
 
 	// LAB 3: Your code here.
+	uintptr_t start, fend, va, lo, hi;
 	struct Elf *Elfhdr = (struct Elf *)binary;
 	if (Elfhdr->e_magic != ELF_MAGIC){
 		panic("load_icode: bad Elf header");
@@ -435,9 +524,24 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 		if(ph->p_filesz > ph->p_memsz || size - ph->p_offset < ph->p_filesz) {
 			panic("load_icode:  out of memory");
 		}
-		region_alloc(e,(void *)ph->p_va,ph->p_memsz);
-		memset((void *) ph->p_va, 0, ph->p_memsz);
-		memcpy((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
+		// Pages wholly inside the file image are copied with
+		// page_copy().  The others come zeroed, which covers the
+		// bss, and get whatever file bytes they hold.  The env does
+		// not run yet, so neither needs to go through the cache.
+		start = ph->p_va;
+		fend = start + ph->p_filesz;
+		for (va = ROUNDDOWN(start, PGSIZE); va < start + ph->p_memsz; va += PGSIZE) {
+			if (va >= start && va + PGSIZE <= fend) {
+				region_alloc(e, (void *)va, PGSIZE, 0);
+				page_copy((void *)va, binary + ph->p_offset + (va - start));
+				continue;
+			}
+			region_alloc(e, (void *)va, PGSIZE, ALLOC_ZERO | ALLOC_NONTEMP);
+			lo = MAX(va, start);
+			hi = MIN(va + PGSIZE, fend);
+			if (lo < hi)
+				memcpy((void *)lo, binary + ph->p_offset + (lo - start), hi - lo);
+		}
 	}
 	lcr3(PADDR(kern_pgdir));
 
@@ -448,7 +552,7 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
 	// Now map one page for the program's initial stack
 	// at virtual address USTACKTOP - PGSIZE.
 	// LAB 8: Your code here.
-	region_alloc(e, (void *)(USTACKTOP - PGSIZE), PGSIZE);
+	region_alloc(e, (void *)(USTACKTOP - PGSIZE), PGSIZE, ALLOC_ZERO);
 }
 
 //
@@ -475,7 +579,10 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
 	if(type == ENV_TYPE_FS){
 		e->env_tf.tf_eflags |= FL_IOPL_3;
 	}
-	
+
+	env_lock(e);
+	sched_enqueue(e);
+	env_unlock(e);
 }
 
 //
@@ -496,6 +603,8 @@ env_free(struct Env *e)
 		lcr3(PADDR(kern_pgdir));
 #endif
 
+	fpu_free(e);
+
 	// Note the environment's demise.
 	//cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
@@ -508,6 +617,10 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a page table shared with another env stays with it
+		if (pgdir_unshare_pt(e->env_pgdir, pdeno))
+			continue;
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -529,13 +642,18 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 #endif
 	// return the environment to the free list
+	sched_dequeue(e);
 	e->env_status = ENV_FREE;
+	e->env_oncpu = 0;
+	spin_lock(&env_alloc_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_alloc_lock);
 }
 
 //
-// Frees environment e.
+// Frees environment e, which the caller has locked with env_lock();
+// the lock is released.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
@@ -543,15 +661,17 @@ void
 env_destroy(struct Env *e)
 {
 //#ifdef CONFIG_KSPACE
-	// If e is currently running on other CPUs, we change its state to
+	// If e is currently held by another CPU, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
+	// it traps to the kernel or that CPU lets go of it.
+	if (e->env_oncpu && curenv != e) {
 		e->env_status = ENV_DYING;
+		env_unlock(e);
 		return;
 	}
 
 	env_free(e);
+	env_unlock(e);
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -570,6 +690,7 @@ env_destroy(struct Env *e)
 void
 csys_exit(void)
 {
+	env_lock(curenv);
 	env_destroy(curenv);
 }
 
@@ -661,17 +782,17 @@ env_run(struct Env *e)
 
 	
 
+	// The scheduler has already let go of the previous environment
+	// and claimed e (ENV_RUNNING, env_oncpu) under e's lock; see
+	// sched_yield().  Otherwise e is the one this CPU is running.
 	if(curenv != e){ 
 		/*cprintf("\nenvrun %s: %x\n",
 		e->env_status == ENV_RUNNING ? "RUNNING" :
 		    e->env_status == ENV_RUNNABLE ? "RUNNABLE" : "(unknown)",
 		e->env_id);*/
-		if(curenv && curenv->env_status == ENV_RUNNING){
-			curenv->env_status = ENV_RUNNABLE;
-			curenv->env_cputime += read_tsc() - curenv->env_cputime_start;
-		}
+		assert(!curenv && e->env_oncpu);
 		curenv = e;
-		curenv->env_status = ENV_RUNNING;
+		curenv->env_cpunum = cpunum();
 		curenv->env_runs++;
 		curenv->env_cputime_start = read_tsc();
 		lcr3(PADDR(curenv->env_pgdir));
@@ -7,7 +7,7 @@
 #include <kern/cpu.h>
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;
+#define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
 void	env_init(void);
@@ -15,9 +15,15 @@ void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, size_t size, enum EnvType type);
-void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_destroy(struct Env *e);	// Does not return if e == curenv; e locked
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_locked(envid_t envid, struct Env **env_store, bool checkperm);
+bool	env_alive(struct Env *e, envid_t envid);
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock_pair(struct Env *a, struct Env *b);
+void	env_unlock_pair(struct Env *a, struct Env *b);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
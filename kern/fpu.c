@@ -0,0 +1,126 @@
+// Lazy x87/SSE state switching.
+//
+// Each environment that has used the FPU gets a FXSAVE area.  A CPU
+// runs with CR0.TS set unless the FPU registers hold the state of its
+// current environment (cpu_fpu_owner), so the first FPU or SSE
+// instruction after a switch traps with #NM and fpu_trap() loads the
+// state then.  Environments that never touch the FPU never pay for a
+// save or restore.
+//
+// The state is written back when its owner stops running on the CPU
+// (fpu_release(), from sched_yield()), because the environment may
+// next run on a different CPU.
+//
+// The kernel itself never uses the FPU: it is built with -mno-sse.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/fpu.h>
+
+#define CPUID_FEAT_FXSR		(1 << 24)
+#define MXCSR_DEFAULT		0x1f80	// All SIMD exceptions masked
+
+struct FxsaveArea {
+	uint8_t fx_data[512];
+} __attribute__((aligned(16)));
+
+static struct FxsaveArea env_fpu[NENV];
+static bool env_fpu_used[NENV];
+
+// State a new environment starts from: after fninit, default MXCSR.
+static struct FxsaveArea fpu_init_state;
+
+static bool fpu_enabled;
+
+static inline void
+fxsave(struct FxsaveArea *fx)
+{
+	asm volatile("fxsave %0" : "=m" (*fx));
+}
+
+static inline void
+fxrstor(struct FxsaveArea *fx)
+{
+	asm volatile("fxrstor %0" : : "m" (*fx));
+}
+
+// Turn on FXSAVE/SSE support for this CPU and leave the FPU trapping.
+void
+fpu_init_percpu(void)
+{
+	uint32_t edx, mxcsr = MXCSR_DEFAULT;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_FEAT_FXSR)) {
+		// #NM stays an unhandled trap, which kills the env.
+		cprintf("CPU %d: no FXSAVE, FPU disabled\n", cpunum());
+		lcr0(rcr0() | CR0_EM);
+		return;
+	}
+
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+	lcr0((rcr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+
+	if (thiscpu == bootcpu) {
+		asm volatile("fninit");
+		asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+		fxsave(&fpu_init_state);
+		fpu_enabled = 1;
+	}
+
+	thiscpu->cpu_fpu_owner = NULL;
+	lcr0(rcr0() | CR0_TS);
+}
+
+// #NM from user mode: give the FPU to curenv.
+void
+fpu_trap(void)
+{
+	struct CpuInfo *c = thiscpu;
+	int i = curenv - envs;
+
+	assert(fpu_enabled && curenv);
+	clts();
+	if (c->cpu_fpu_owner == curenv)
+		return;
+	assert(!c->cpu_fpu_owner);
+
+	if (env_fpu_used[i])
+		fxrstor(&env_fpu[i]);
+	else {
+		fxrstor(&fpu_init_state);
+		env_fpu_used[i] = 1;
+	}
+	c->cpu_fpu_owner = curenv;
+}
+
+// e stops running on this CPU: save its FPU state if it is live here.
+void
+fpu_release(struct Env *e)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (c->cpu_fpu_owner != e)
+		return;
+	fxsave(&env_fpu[e - envs]);
+	c->cpu_fpu_owner = NULL;
+	lcr0(rcr0() | CR0_TS);
+}
+
+// e is being freed: forget its state, so its slot starts fresh.
+void
+fpu_free(struct Env *e)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (c->cpu_fpu_owner == e) {
+		c->cpu_fpu_owner = NULL;
+		lcr0(rcr0() | CR0_TS);
+	}
+	env_fpu_used[e - envs] = 0;
+}
@@ -0,0 +1,16 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+struct Env;
+
+void fpu_init_percpu(void);
+void fpu_trap(void);
+void fpu_release(struct Env *e);
+void fpu_free(struct Env *e);
+
+#endif	// !JOS_KERN_FPU_H
@@ -14,6 +14,11 @@
 #include <kern/cpu.h>
 #include <kern/picirq.h>
 #include <kern/kclock.h>
+#include <kern/spinlock.h>
+
+#ifndef CONFIG_KSPACE
+static void boot_aps(void);
+#endif
 
 void
 i386_init(void)
@@ -39,12 +44,20 @@ i386_init(void)
 #ifndef CONFIG_KSPACE
 	// Lab 6 memory management initialization functions
 	mem_init();
+	clock_publish();
 #endif
 
 	// user environment initialization functions
 	env_init();
+	sched_init();
 	trap_init();
 
+#ifndef CONFIG_KSPACE
+	// Multiprocessor initialization functions
+	mp_init();
+	lapic_init();
+#endif
+
 	clock_idt_init();
 
 	pic_init();
@@ -73,10 +86,69 @@ i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 
+#ifndef CONFIG_KSPACE
+	// Starting non-boot CPUs.  There is no big kernel lock to hold
+	// them back, so only do this once the first environments exist;
+	// otherwise an AP would find nothing to run and enter the monitor.
+	boot_aps();
+#endif
+
 	// Schedule and run the first user environment!
 	sched_yield();
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+#ifndef CONFIG_KSPACE
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == cpus + cpunum())  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_id, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while(c->cpu_status != CPU_STARTED)
+			;
+	}
+}
+#endif
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// We are in high EIP now, safe to switch to kern_pgdir
+	lcr3(PADDR(kern_pgdir));
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	env_init_percpu();
+	trap_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Now that we have finished some basic setup, call sched_yield()
+	// to start running processes on this CPU.
+	sched_yield();
+}
+
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
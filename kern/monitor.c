@@ -14,6 +14,7 @@
 
 #include <kern/tsc.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -33,6 +34,7 @@ static struct Command commands[] = {
 	{ "start", "Start tsc", tsc_start },
 	{ "stop", "Stop tsc", tsc_stop },
 	{ "pages", "Stop tsc", mon_pages},
+	{ "lockstat", "Display spinlock contention [reset]", mon_lockstat },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -145,6 +147,13 @@ tsc_stop(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	spin_lockstat(argc > 1 && strcmp(argv[1], "reset") == 0);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -19,5 +19,6 @@ int mon_text(int argc, char **argv, struct Trapframe *tf);
 int tsc_start(int argc, char **argv, struct Trapframe *tf);
 int tsc_stop(int argc, char **argv, struct Trapframe *tf);
 int mon_pages(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
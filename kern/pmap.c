@@ -7,11 +7,14 @@
 #include <inc/assert.h>
 #include <inc/memlayout.h>
 #include <inc/vsyscall.h>
+#include <inc/trap.h>
 
 #include <kern/vsyscall.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -22,6 +25,10 @@ int *vsys;  // Virtual syscall space
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
+// Protects page_free_list and the pp_ref counts of all pages
+static struct spinlock page_lock = SPINLOCK_INIT(page_lock, LOCK_PAGE);
+// Serializes edits to page tables shared between envs, see pt_is_shared()
+static struct spinlock ptshare_lock = SPINLOCK_INIT(ptshare_lock, LOCK_PGTABLE);
 
 
 // --------------------------------------------------------------
@@ -63,6 +70,7 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void mem_init_mp(void);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -70,7 +78,7 @@ static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
 
-extern pte_t entry_pgtable0[NPTENTRIES];
+extern pte_t entry_pgtable1[NPTENTRIES];
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -107,7 +115,8 @@ boot_alloc(uint32_t n)
 	// LAB 6: Your code here.
 	char *ret = nextfree;
 	nextfree = ROUNDUP(nextfree + n, PGSIZE);
-	if(PADDR(nextfree) > entry_pgtable0[NPTENTRIES - 1] + PGSIZE) {
+	// entry_pgdir maps the first 8MB: both entry page tables.
+	if(PADDR(nextfree) > PTE_ADDR(entry_pgtable1[NPTENTRIES - 1]) + PGSIZE) {
 		panic("Out of memory");
 	}
 	return ret;
@@ -207,19 +216,6 @@ mem_init(void)
 	// LAB 12: Your code here.
 	boot_map_region(kern_pgdir, UVSYS, ROUNDUP(sizeof(int) * NVSYSCALLS , PGSIZE), PADDR(vsys), PTE_U);
 
-	//////////////////////////////////////////////////////////////////////
-	// Use the physical memory that 'bootstack' refers to as the kernel
-	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
-	// We consider the entire range from [KSTACKTOP-PTSIZE, KSTACKTOP)
-	// to be the kernel stack, but break this into two pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
-	//       the kernel overflows its stack, it will fault rather than
-	//       overwrite memory.  Known as a "guard page".
-	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
-	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
-
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
 	// Ie.  the VA range [KERNBASE, 2^32) should map to
@@ -230,6 +226,9 @@ mem_init(void)
 	// Your code goes here:
 	boot_map_region(kern_pgdir, KERNBASE, ROUNDUP(0xfffff000 - KERNBASE, PGSIZE), 0x0, PTE_W);
 
+	// Initialize the SMP-related parts of the memory map
+	mem_init_mp();
+
 	// Check that the initial page directory has been set up correctly.
 	//check_kern_pgdir();
 	check_kern_pgdir();
@@ -256,6 +255,35 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+// Modify mappings in kern_pgdir to support SMP
+//   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
+//
+static void
+mem_init_mp(void)
+{
+	// Map per-CPU stacks starting at KSTACKTOP, for up to 'NCPU' CPUs.
+	//
+	// For CPU i, use the physical memory that 'percpu_kstacks[i]' refers
+	// to as its kernel stack. CPU i's kernel stack grows down from virtual
+	// address kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP), and is
+	// divided into two pieces:
+	//     * [kstacktop_i - KSTKSIZE, kstacktop_i)
+	//          -- backed by physical memory
+	//     * [kstacktop_i - (KSTKSIZE + KSTKGAP), kstacktop_i - KSTKSIZE)
+	//          -- not backed; so if the kernel overflows its stack,
+	//             it will fault rather than overwrite another CPU's stack.
+	//             Known as a "guard page".
+	//     Permissions: kernel RW, user NONE
+	int i;
+	uintptr_t kstacktop_i;
+
+	for (i = 0; i < NCPU; i++) {
+		kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE,
+				PADDR(percpu_kstacks[i]), PTE_W);
+	}
+}
+
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
@@ -284,6 +312,8 @@ page_init(void)
 	//     Some of it is in use, some is free. Where is the kernel
 	//     in physical memory?  Which pages are already in use for
 	//     page tables and other data structures?
+	//  5) The page at MPENTRY_PADDR holds the AP bootstrap code
+	//     (see boot_aps()), so it must stay off the free list too.
 	//
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
@@ -292,6 +322,11 @@ page_init(void)
 	pages[0].pp_link = NULL;
 	size_t i;
 	for (i = npages - 1; i > 0; i--) {
+		if (i == MPENTRY_PADDR / PGSIZE) {
+			pages[i].pp_ref = 1;
+			pages[i].pp_link = NULL;
+			continue;
+		}
 		if (i >= IOPHYSMEM / PGSIZE && i < EXTPHYSMEM / PGSIZE ){
 			pages[i].pp_ref = 1;
 			pages[i].pp_link = NULL;
@@ -309,7 +344,8 @@ page_init(void)
 
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes.  Does NOT increment the reference
+// returned physical page with '\0' bytes, bypassing the cache if
+// (alloc_flags & ALLOC_NONTEMP).  Does NOT increment the reference
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
@@ -322,19 +358,26 @@ page_init(void)
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	struct PageInfo *ret_val = page_free_list;
+	struct PageInfo *ret_val;
 
+	spin_lock(&page_lock);
+	ret_val = page_free_list;
 	if (ret_val) {
 		page_free_list = page_free_list->pp_link;
 
 		ret_val->pp_ref = 0;
 		ret_val->pp_link = NULL;
+	}
+	spin_unlock(&page_lock);
 
-		if (alloc_flags & ALLOC_ZERO) {
+	// The page is ours now; clear it outside the lock.
+	if (ret_val && (alloc_flags & ALLOC_ZERO)) {
+		if (alloc_flags & ALLOC_NONTEMP)
+			page_zero(page2kva(ret_val));
+		else
 			memset(page2kva(ret_val), 0, PGSIZE);
-		}
 	}
-	
+
 	return ret_val;
 }
 
@@ -356,8 +399,10 @@ page_free(struct PageInfo *pp)
 		panic("pp->pp_link is not NULL");
 	}
 
+	spin_lock(&page_lock);
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
+	spin_unlock(&page_lock);
 }
 
 //
@@ -367,10 +412,27 @@ page_free(struct PageInfo *pp)
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	uint16_t ref;
+
+	spin_lock(&page_lock);
+	ref = --pp->pp_ref;
+	spin_unlock(&page_lock);
+	// Nobody else holds a reference, so nobody can revive it.
+	if (ref == 0)
 		page_free(pp);
 }
 
+//
+// Increment the reference count on a page.
+//
+void
+page_incref(struct PageInfo *pp)
+{
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -416,6 +478,21 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	return &ptable[PTX(va)];
 }
 
+// Is the page table mapping va in pgdir also used by another env's
+// page directory (pgdir_share_range)?  Then other CPUs may be using it
+// and other envs editing it, each under its own env lock only, so
+// edits take ptshare_lock and may need a TLB shootdown.  A table only
+// becomes shared while its owners are locked, and stops being shared
+// when one of them is freed, so the answer cannot go stale in a way
+// that matters.
+static bool
+pt_is_shared(pde_t *pgdir, const void *va)
+{
+	pde_t pde = pgdir[PDX(va)];
+
+	return (pde & PTE_P) && pa2page(PTE_ADDR(pde))->pp_ref > 1;
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
@@ -469,27 +546,34 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 {
-	// Fill this function in
-	pte_t *pte = pgdir_walk(pgdir, va, 0);
-
-    if (pte) {
-        if (*pte & PTE_P){
-			if (PTE_ADDR(*pte) == page2pa(pp)){
-				*pte = page2pa(pp) | perm | PTE_P;
-				tlb_invalidate(pgdir, va);
-				return 0;
-			}
-            page_remove(pgdir, va);
-		}
-    } else {
-	    pte = pgdir_walk(pgdir, va, 1);
-	    if (!pte){
-		    return -E_NO_MEM;
-		}
-    }
-	*pte = page2pa(pp) | perm | PTE_P;
-	pp->pp_ref++;
-    tlb_invalidate(pgdir, va);
+	bool shared = pt_is_shared(pgdir, va);
+	pte_t *pte, old, new = page2pa(pp) | perm | PTE_P;
+
+	if (shared)
+		spin_lock(&ptshare_lock);
+	if (!(pte = pgdir_walk(pgdir, va, 1))) {
+		if (shared)
+			spin_unlock(&ptshare_lock);
+		return -E_NO_MEM;
+	}
+	// Count the new reference before dropping the old one: pp may be
+	// the page already mapped at va.
+	page_incref(pp);
+	old = *pte;
+	*pte = new;
+	if (shared)
+		spin_unlock(&ptshare_lock);
+
+	if (old & PTE_P) {
+		// Other CPUs may go on using a stale entry that grants no
+		// more than the new one does; only the user's page fault
+		// handler notices, and it just returns.
+		if (shared && (PTE_ADDR(old) != PTE_ADDR(new) || (old & ~new & PTE_W)))
+			tlb_shootdown();
+		else
+			tlb_invalidate(pgdir, va);
+		page_decref(pa2page(PTE_ADDR(old)));
+	}
 	return 0;
 }
 
@@ -542,16 +626,25 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 void
 page_remove(pde_t *pgdir, void *va)
 {
-	// Fill this function in
+	bool shared = pt_is_shared(pgdir, va);
+	struct PageInfo *pp;
 	pte_t *pte;
-	struct PageInfo *pp = page_lookup(pgdir, va, &pte);
-	if(!pp){
+
+	if (shared)
+		spin_lock(&ptshare_lock);
+	if ((pp = page_lookup(pgdir, va, &pte)) != NULL)
+		*pte = 0;
+	if (shared)
+		spin_unlock(&ptshare_lock);
+	if (!pp)
 		return;
-	}
-	
+
+	// The page may only be freed once no TLB can reach it
+	if (shared)
+		tlb_shootdown();
+	else
+		tlb_invalidate(pgdir, va);
 	page_decref(pp);
-	*pte = 0;
-	tlb_invalidate(pgdir, va);
 }
 
 //
@@ -566,6 +659,96 @@ tlb_invalidate(pde_t *pgdir, void *va)
 		invlpg(va);
 }
 
+// TLB shootdown.
+//
+// A CPU only caches the page tables of the env it runs, and switching
+// envs reloads %cr3, so changes to an env's own page tables need at
+// most a local invlpg.  Page tables shared between envs can be in use
+// on several CPUs at once, though, so taking away a mapping there
+// means flushing every CPU.  The initiator bumps tlb_gen and sends the
+// others an IPI; each flushes its TLB and records in cpu_tlb_gen the
+// generation it has caught up with.  In the kernel interrupts are off,
+// so spin_lock() polls too: the initiator may hold the lock a CPU is
+// spinning on.  Halted CPUs run on kern_pgdir and need no flush.
+static volatile uint32_t tlb_gen;
+
+// Catch up with the latest shootdown.
+void
+tlb_shootdown_poll(void)
+{
+	struct CpuInfo *c = thiscpu;
+	uint32_t gen = tlb_gen;
+
+	if (c->cpu_tlb_gen != gen) {
+		c->cpu_tlb_gen = gen;
+		lcr3(rcr3());
+	}
+}
+
+// Flush every CPU's TLB, and wait until they all have.
+void
+tlb_shootdown(void)
+{
+	uint32_t gen = xadd(&tlb_gen, 1) + 1;
+	struct CpuInfo *c;
+
+	tlb_shootdown_poll();
+	if (ncpu == 1)
+		return;
+	lapic_ipi(T_TLBFLUSH);
+	for (c = cpus; c < cpus + ncpu; c++)
+		while (c->cpu_status == CPU_STARTED
+		       && (int32_t) (c->cpu_tlb_gen - gen) < 0) {
+			tlb_shootdown_poll();
+			asm volatile("pause");
+		}
+}
+
+// Make dst's page directory entries for [va, va + size) point at
+// src's page tables, allocating any that src does not have yet.  From
+// then on every page mapped or unmapped in the range by either side
+// shows up in both.  va and size must be multiples of PTSIZE.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL if dst already has a page table in the range
+//   -E_NO_MEM if a page table couldn't be allocated
+int
+pgdir_share_range(pde_t *src, pde_t *dst, uintptr_t va, size_t size)
+{
+	uintptr_t a;
+
+	for (a = va; a < va + size; a += PTSIZE)
+		if (dst[PDX(a)] & PTE_P)
+			return -E_INVAL;
+	for (a = va; a < va + size; a += PTSIZE) {
+		if (!pgdir_walk(src, (void *) a, 1))
+			return -E_NO_MEM;
+		page_incref(pa2page(PTE_ADDR(src[PDX(a)])));
+		dst[PDX(a)] = src[PDX(a)];
+	}
+	return 0;
+}
+
+// If pgdir shares its page table for page directory entry pdeno with
+// another env, drop pgdir's reference to it and return 1: the pages
+// stay mapped for the others.  Returns 0, leaving the table alone, if
+// pgdir is its only user.
+bool
+pgdir_unshare_pt(pde_t *pgdir, uint32_t pdeno)
+{
+	struct PageInfo *pt = pa2page(PTE_ADDR(pgdir[pdeno]));
+	bool shared;
+
+	spin_lock(&ptshare_lock);
+	if ((shared = pt->pp_ref > 1)) {
+		pgdir[pdeno] = 0;
+		page_decref(pt);
+	}
+	spin_unlock(&ptshare_lock);
+	return shared;
+}
+
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
 // location.  Return the base of the reserved region.  size does *not*
@@ -578,7 +761,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 	// beginning of the MMIO region.  Because this is static, its
 	// value will be preserved between calls to mmio_map_region
 	// (just like nextfree in boot_alloc).
-	static uintptr_t base = MMIOBASE; base=base;
+	static uintptr_t base = MMIOBASE;
 
 	// Reserve size bytes of virtual memory starting at base and
 	// map physical pages [pa,pa+size) to virtual addresses
@@ -598,7 +781,14 @@ mmio_map_region(physaddr_t pa, size_t size)
 	// Hint: The staff solution uses boot_map_region.
 	//
 	// Your code here:
-	panic("mmio_map_region not implemented");
+	uintptr_t ret = base;
+
+	size = ROUNDUP(size, PGSIZE);
+	if (base + size > MMIOLIM || base + size < base)
+		panic("mmio_map_region: reservation overflows MMIOLIM");
+	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD | PTE_PWT | PTE_W);
+	base += size;
+	return (void *) ret;
 }
 
 static uintptr_t user_mem_check_addr;
@@ -654,6 +844,7 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 // If it can, then the function simply returns.
 // If it cannot, 'env' is destroyed and, if env is the current
 // environment, this function will not return.
+// The caller must not hold env's lock.
 //
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
@@ -661,6 +852,7 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
+		env_lock(env);
 		env_destroy(env);	// may not return
 	}
 }
@@ -717,6 +909,7 @@ check_page_free_list(bool only_low_memory)
 		assert(page2pa(pp) != IOPHYSMEM);
 		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
 		assert(page2pa(pp) != EXTPHYSMEM);
+		assert(page2pa(pp) != MPENTRY_PADDR);
 		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
 
 		if (page2pa(pp) < EXTPHYSMEM)
@@ -837,10 +1030,15 @@ check_kern_pgdir(void)
 	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
-	assert(check_va2pa(pgdir, KSTACKTOP - PTSIZE) == ~0);
+	// check per-CPU kernel stacks
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, base + i) == ~0);
+	}
 
 	// check PDE permissions
 	for (i = 0; i < NPDENTRIES; i++) {
@@ -852,6 +1050,9 @@ check_kern_pgdir(void)
 		case PDX(UVSYS):
 			assert(pgdir[i] & PTE_P);
 			break;
+		case PDX(MMIOBASE):
+			// Populated later by mmio_map_region()
+			break;
 		default:
 			if (i >= PDX(KERNBASE)) {
 				assert(pgdir[i] & PTE_P);
@@ -49,6 +49,9 @@ _kaddr(const char *file, int line, physaddr_t pa)
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// With ALLOC_ZERO, zero it with non-temporal stores, which keep
+	// it out of the cache: for pages nobody is about to touch.
+	ALLOC_NONTEMP = 1<<1,
 };
 
 void	mem_init(void);
@@ -60,10 +63,16 @@ int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_incref(struct PageInfo *pp);
 
 int is_page_free(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_shootdown(void);
+void	tlb_shootdown_poll(void);
+
+int	pgdir_share_range(pde_t *src, pde_t *dst, uintptr_t va, size_t size);
+bool	pgdir_unshare_pt(pde_t *pgdir, uint32_t pdeno);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
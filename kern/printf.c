@@ -4,6 +4,7 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/console.h>
 
 
 static void
@@ -18,7 +19,10 @@ vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
 
+	// Keep each message whole when several CPUs print at once
+	cons_lock();
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	cons_unlock();
 	return cnt;
 }
 
@@ -3,72 +3,251 @@
 #include <kern/env.h>
 #include <kern/monitor.h>
 #include <kern/tsc.h>
+#include <kern/pmap.h>
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
 
-
-struct Taskstate cpu_ts;
 void sched_halt(void);
 
+// Per-CPU run queue.  Holds the environments waiting for this CPU:
+// ENV_RUNNABLE ones in FIFO order and ENV_SLEEPING ones parked here
+// until their wakeup time.  Each queue has its own lock, so picking
+// the next environment never touches another CPU's queue unless this
+// one is empty and we go stealing.  An environment is on at most one
+// queue (env_rq_cpu), and never on one while a CPU holds it as
+// curenv (env_oncpu): that CPU queues it when it lets go.
+struct RunQueue {
+	struct spinlock rq_lock;
+	struct Env *rq_head;
+	struct Env *rq_tail;
+	int rq_len;
+};
+
+static struct RunQueue runqueues[NCPU];
+
+void
+sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		spin_initlock(&runqueues[i].rq_lock, LOCK_RUNQUEUE);
+}
+
+// Can e run on CPU id?
+static bool
+cpu_allowed(struct Env *e, int id)
+{
+	return !e->env_cpumask || (e->env_cpumask & (1 << id));
+}
+
+// Unlink e from rq.  Caller holds rq->rq_lock.
+static void
+rq_unlink(struct RunQueue *rq, struct Env *e)
+{
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+	rq->rq_len--;
+}
+
+// Choose the run queue for e: the current CPU if e may run here
+// (keeps the cache warm, idle CPUs will steal the surplus), else the
+// least loaded CPU in its affinity mask.
+static int
+rq_target(struct Env *e)
+{
+	int i, id = cpunum(), best = -1;
+
+	if (cpu_allowed(e, id))
+		return id;
+	for (i = 0; i < ncpu; i++)
+		if (cpu_allowed(e, i) &&
+		    (best < 0 || runqueues[i].rq_len < runqueues[best].rq_len))
+			best = i;
+	return best < 0 ? id : best;
+}
+
+// Take e off whatever run queue it is on.
+void
+sched_dequeue(struct Env *e)
+{
+	struct RunQueue *rq;
+	int id = e->env_rq_cpu;
+
+	if (id < 0)
+		return;
+	rq = &runqueues[id];
+	spin_lock(&rq->rq_lock);
+	if (e->env_rq_cpu == id)
+		rq_unlink(rq, e);
+	spin_unlock(&rq->rq_lock);
+}
+
+// Put e, which must be ENV_RUNNABLE or ENV_SLEEPING, at the tail of
+// a run queue.  Moves it if it was already queued elsewhere.
+// The caller holds e's env lock.
+void
+sched_enqueue(struct Env *e)
+{
+	struct RunQueue *rq;
+	int id;
+
+	assert(e->env_status == ENV_RUNNABLE || e->env_status == ENV_SLEEPING);
+	if (e->env_oncpu)
+		return;
+	sched_dequeue(e);
+
+	id = rq_target(e);
+	rq = &runqueues[id];
+	spin_lock(&rq->rq_lock);
+	e->env_rq_cpu = id;
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail;
+	if (rq->rq_tail)
+		rq->rq_tail->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_tail = e;
+	rq->rq_len++;
+	spin_unlock(&rq->rq_lock);
+}
+
+// Is e sleeping with its wakeup time still in the future?
+static bool
+still_asleep(struct Env *e)
+{
+	if (e->env_status != ENV_SLEEPING)
+		return 0;
+	return clock_ns(e->env_sleep_clockid) <
+		timespec_to_ns(&e->env_wakeup_time);
+}
+
+// Pop the first runnable environment (or expired sleeper) off CPU
+// id's own queue, dropping entries that stopped being runnable
+// (killed, blocked in IPC) on the way.  Statuses are only read here;
+// sched_claim() rechecks them under the env lock.
+static struct Env *
+rq_pick(int id)
+{
+	struct RunQueue *rq = &runqueues[id];
+	struct Env *e, *next;
+
+	spin_lock(&rq->rq_lock);
+	for (e = rq->rq_head; e; e = next) {
+		next = e->env_rq_next;
+		if (still_asleep(e))
+			continue;
+		rq_unlink(rq, e);
+		if (e->env_status == ENV_RUNNABLE ||
+		    e->env_status == ENV_SLEEPING)
+			break;
+	}
+	spin_unlock(&rq->rq_lock);
+	return e;
+}
+
+// Our queue is empty: take a runnable environment from the tail of
+// another CPU's queue, trying each CPU once starting with our neighbour.
+static struct Env *
+rq_steal(int id)
+{
+	struct RunQueue *rq;
+	struct Env *e;
+	int i;
+
+	for (i = 1; i < ncpu; i++) {
+		rq = &runqueues[(id + i) % ncpu];
+		if (!rq->rq_len)
+			continue;
+		spin_lock(&rq->rq_lock);
+		for (e = rq->rq_tail; e; e = e->env_rq_prev)
+			if (e->env_status == ENV_RUNNABLE && cpu_allowed(e, id)) {
+				rq_unlink(rq, e);
+				break;
+			}
+		spin_unlock(&rq->rq_lock);
+		if (e)
+			return e;
+	}
+	return NULL;
+}
+
+// Stop holding curenv on this CPU.  Whatever happened to it while it
+// ran decides where it goes: still running means preempted (back to
+// the tail of a queue), runnable or sleeping go to a queue, a zombie
+// is freed here, and a blocked one is left for its waker to queue.
+static void
+sched_release(struct Env *e)
+{
+	env_lock(e);
+	fpu_release(e);
+	curenv = NULL;
+	e->env_oncpu = 0;
+	e->env_cputime += read_tsc() - e->env_cputime_start;
+#ifndef CONFIG_KSPACE
+	// Once unlocked, another CPU may free e and its page directory.
+	lcr3(PADDR(kern_pgdir));
+#endif
+	if (e->env_status == ENV_RUNNING)
+		e->env_status = ENV_RUNNABLE;
+	if (e->env_status == ENV_DYING)
+		env_free(e);
+	else if (e->env_status == ENV_RUNNABLE || e->env_status == ENV_SLEEPING)
+		sched_enqueue(e);
+	env_unlock(e);
+}
+
+// Take e, just picked off a queue, for this CPU.  Fails if e was
+// killed, blocked or claimed elsewhere since it was queued.
+static bool
+sched_claim(struct Env *e)
+{
+	bool ok = 0;
+
+	env_lock(e);
+	if (e->env_status == ENV_SLEEPING)
+		e->env_status = ENV_RUNNABLE;
+	if (e->env_status == ENV_RUNNABLE && !e->env_oncpu &&
+	    e->env_rq_cpu < 0) {
+		e->env_status = ENV_RUNNING;
+		e->env_oncpu = 1;
+		ok = 1;
+	}
+	env_unlock(e);
+	return ok;
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env was
-	// last running.  Switch to the first such environment found.
+	// Round-robin over this CPU's run queue.  The environment we are
+	// leaving goes back to the tail, so every queued environment gets
+	// its turn; if nothing else is runnable it is simply picked again.
 	//
-	// If no envs are runnable, but the environment previously
-	// running is still ENV_RUNNING, it's okay to
-	// choose that environment.
+	// If our queue has nothing runnable, steal from another CPU.
+	// Otherwise halt the cpu.
 	//
-	// If there are no runnable environments,
-	// simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 3: Your code here.
-	int sleeping = 0;
-
-	uint32_t i = 1;
-	do{
-		struct Env *e = envs - 1;
-		if(curenv){
-			e = curenv;
-		}
-		for(;e + i < envs + NENV; i++){
-			if (e[i].env_status == ENV_SLEEPING){
-				sleeping = 1;
-				struct timespec tp;
-				clock_gettime(e[i].env_sleep_clockid, &tp);
-				tp = sub_timespec(&tp, &e[i].env_wakeup_time);
-				if(tp.tv_sec >= 0 && tp.tv_nsec >= 0){
-					e[i].env_status = ENV_RUNNABLE;
-					sleeping = 0;
-				}
-			}
-			if (e[i].env_status == ENV_RUNNABLE){
-				env_run(&e[i]);
-				return;
-			}
-		}
-		i = 0;
-		for(;envs + i <= curenv; i++){
-			if (e[i].env_status == ENV_SLEEPING){
-				sleeping = 1;
-				struct timespec tp;
-				clock_gettime(e[i].env_sleep_clockid, &tp);
-				tp = sub_timespec(&tp, &e[i].env_wakeup_time);
-				if(tp.tv_sec >= 0 && tp.tv_nsec >= 0){
-					e[i].env_status = ENV_RUNNABLE;
-					sleeping = 0;
-				}
-			}
-			if ((envs[i].env_status == ENV_RUNNABLE || envs[i].env_status == ENV_RUNNING)){
-				env_run(&envs[i]);
-				return;
-			}
-		}
-	} while(sleeping);
+	// No global lock is taken: only this CPU's run queue (or the
+	// victim's when stealing) and the env locks of the environments
+	// we switch between.
+	struct Env *e;
+	int id = cpunum();
+
+	if (curenv)
+		sched_release(curenv);
+
+	while ((e = rq_pick(id)) || (e = rq_steal(id)))
+		if (sched_claim(e))
+			env_run(e);
 
 	// sched_halt never returns
 	sched_halt();
@@ -97,8 +276,12 @@ sched_halt(void)
 			monitor(NULL);
 	}
 
-	// Mark that no environment is running on CPU
-	curenv = NULL;
+	// No environment is running on this CPU: sched_yield() has
+	// already let go of curenv and switched to kern_pgdir.
+	assert(!curenv);
+
+	// Mark that this CPU is in the HALT state
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -107,6 +290,8 @@ sched_halt(void)
 		"pushl $0\n"
 		"pushl $0\n"
 		"sti\n"
+		"1:\n"
 		"hlt\n"
-	: : "a" (cpu_ts.ts_esp0));
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
 }
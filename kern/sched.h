@@ -6,6 +6,12 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
+void sched_init(void);
+void sched_enqueue(struct Env *e);
+void sched_dequeue(struct Env *e);
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
@@ -7,15 +7,9 @@
 #include <inc/string.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/pmap.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
-
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -39,16 +33,68 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked;
+	return lock->owner != lock->next && lock->cpu == thiscpu;
+}
+
+// Every lock acquired at least once, for spin_lockstat().
+static struct spinlock *lockstat_list;
+
+// Called with lk held, so only one CPU ever adds a given lock.
+static void
+lockstat_add(struct spinlock *lk)
+{
+	uint32_t head;
+
+	lk->stat_listed = 1;
+	do {
+		head = (uint32_t) lockstat_list;
+		lk->stat_next = (struct spinlock *) head;
+	} while (cmpxchg((volatile uint32_t *) &lockstat_list,
+			 head, (uint32_t) lk) != head);
+}
+
+// Enforce the lock order documented in kern/spinlock.h against the
+// locks this CPU already holds, then record lk as held.
+static void
+check_order(struct spinlock *lk)
+{
+	struct CpuInfo *c = thiscpu;
+	struct spinlock *h;
+	int i;
+
+	for (i = 0; i < c->cpu_nlocks; i++) {
+		h = c->cpu_locks[i];
+		if (h->rank > lk->rank || (h->rank == lk->rank && h >= lk))
+			panic("lock order: acquiring %s (rank %d) while holding %s (rank %d)",
+			      lk->name, lk->rank, h->name, h->rank);
+	}
+	if (c->cpu_nlocks == NLOCKHELD)
+		panic("lock order: too many locks held acquiring %s", lk->name);
+	c->cpu_locks[c->cpu_nlocks++] = lk;
+}
+
+static void
+forget_held(struct spinlock *lk)
+{
+	struct CpuInfo *c = thiscpu;
+	int i;
+
+	for (i = 0; i < c->cpu_nlocks; i++)
+		if (c->cpu_locks[i] == lk) {
+			c->cpu_locks[i] = c->cpu_locks[--c->cpu_nlocks];
+			return;
+		}
 }
 #endif
 
 void
-__spin_initlock(struct spinlock *lk, char *name)
+__spin_initlock(struct spinlock *lk, char *name, int rank)
 {
-	lk->locked = 0;
+	lk->next = lk->owner = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
+	lk->rank = rank;
+	lk->cpu = 0;
 #endif
 }
 
@@ -59,20 +105,45 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t ticket;
 #ifdef DEBUG_SPINLOCK
+	uint64_t spin = 0;
+
 	if (holding(lk))
 		panic("Cannot acquire %s: already holding", lk->name);
+	check_order(lk);
 #endif
 
-	// The xchg is atomic.
+	// The xadd is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it.
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile ("pause");
+	ticket = xadd(&lk->next, 1);
+	if (lk->owner != ticket) {
+#ifdef DEBUG_SPINLOCK
+		spin = read_tsc();
+#endif
+		// Interrupts are off, so answer TLB shootdowns here: the
+		// CPU holding lk may be waiting for us to.
+		while (lk->owner != ticket) {
+			tlb_shootdown_poll();
+			asm volatile ("pause");
+		}
+#ifdef DEBUG_SPINLOCK
+		spin = read_tsc() - spin;
+#endif
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
+	lk->nacquire++;
+	if (spin) {
+		lk->ncontended++;
+		lk->spin_cycles += spin;
+	}
+	if (!lk->stat_listed)
+		lockstat_add(lk);
 #endif
 }
 
@@ -86,7 +157,8 @@ spin_unlock(struct spinlock *lk)
 		uint32_t pcs[10];
 		// Nab the acquiring EIP chain before it gets released
 		memmove(pcs, lk->pcs, sizeof pcs);
-		cprintf("Cannot release %s\nAcquired at:", lk->name);
+		cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:",
+			cpunum(), lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
 		for (i = 0; i < 10 && pcs[i]; i++) {
 			struct Eipdebuginfo info;
 			if (debuginfo_eip(pcs[i], &info) >= 0)
@@ -101,17 +173,63 @@ spin_unlock(struct spinlock *lk)
 	}
 
 	lk->pcs[0] = 0;
+	lk->cpu = 0;
+	forget_held(lk);
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	// Only the holder writes owner, so a plain store hands the lock
+	// to the next ticket.  The 2007 Intel 64 Architecture Memory
+	// Ordering White Paper says that Intel 64 and IA-32 will not
+	// move a load or store after a later store, so the critical
+	// section cannot leak past it; the compiler barrier keeps gcc
+	// from doing so either.
+	asm volatile ("" : : : "memory");
+	lk->owner++;
+}
+
+// Print the contention statistics of every lock acquired so far,
+// summing locks that share a name (e.g. the per-env locks), and
+// optionally reset them.
+void
+spin_lockstat(bool reset)
+{
+#ifdef DEBUG_SPINLOCK
+	struct spinlock *lk, *l;
+	uint32_t n, nacquire, ncontended;
+	uint64_t spin;
+
+	cprintf("%-24s %5s %10s %10s %12s\n",
+		"lock", "count", "acquire", "contended", "cycles/wait");
+	for (lk = lockstat_list; lk; lk = lk->stat_next) {
+		// Print each name once, at its first lock in the list.
+		for (l = lockstat_list; l != lk; l = l->stat_next)
+			if (strcmp(l->name, lk->name) == 0)
+				break;
+		if (l != lk)
+			continue;
+
+		n = nacquire = ncontended = 0;
+		spin = 0;
+		for (; l; l = l->stat_next) {
+			if (strcmp(l->name, lk->name) != 0)
+				continue;
+			n++;
+			nacquire += l->nacquire;
+			ncontended += l->ncontended;
+			spin += l->spin_cycles;
+		}
+		cprintf("%-24s %5u %10u %10u %12llu\n", lk->name, n,
+			nacquire, ncontended,
+			ncontended ? spin / ncontended : 0ULL);
+	}
+
+	if (reset)
+		for (lk = lockstat_list; lk; lk = lk->stat_next) {
+			lk->nacquire = lk->ncontended = 0;
+			lk->spin_cycles = 0;
+		}
+#else
+	cprintf("Lock statistics need DEBUG_SPINLOCK in kern/spinlock.h\n");
+#endif
 }
 
@@ -6,42 +6,77 @@
 // Comment this to disable spinlock debugging
 //#define DEBUG_SPINLOCK
 
+// Lock ordering.
+//
+// There is no big kernel lock: each subsystem has its own locks, and
+// a CPU may only acquire a lock whose rank is higher than the rank of
+// every lock it already holds.  Locks of equal rank (the per-env
+// locks) are taken in increasing address order, i.e. by ENVX().
+// DEBUG_SPINLOCK builds panic on any violation.
+//
+//   LOCK_ENV        per-env lock (env_lock()): env_status, env_pgdir
+//                   contents, IPC and scheduling fields of one Env
+//   LOCK_ENV_ALLOC  env_free_list
+//   LOCK_RUNQUEUE   one per-CPU run queue (kern/sched.c); a CPU never
+//                   holds two of them
+//   LOCK_PGTABLE    entries of page tables shared between envs
+//                   (sys_region_share, kern/pmap.c)
+//   LOCK_PAGE       page_free_list and every pp_ref count
+//   LOCK_IRQ        user IRQ listener table and the 8259A mask
+//                   (kern/trap.c)
+//   LOCK_CLOCK      clock parameter writers (kern/tsc.c)
+//   LOCK_CONSOLE    console output and input buffer; innermost, so
+//                   cprintf() is allowed under any other lock
+//
+// The kernel runs with interrupts disabled, so a lock is never taken
+// again by an interrupt on the CPU that holds it.
+enum {
+	LOCK_ENV = 1,
+	LOCK_ENV_ALLOC,
+	LOCK_RUNQUEUE,
+	LOCK_PGTABLE,
+	LOCK_PAGE,
+	LOCK_IRQ,
+	LOCK_CLOCK,
+	LOCK_CONSOLE,
+};
+
 // Mutual exclusion lock.
+// A ticket lock: each CPU takes the next ticket and spins until the
+// owner counter reaches it, so waiters are served in FIFO order and
+// only the releasing CPU writes the owner cache line.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;	// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket allowed to hold the lock
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
 	char *name;            // Name of lock.
+	int rank;              // Position in the lock order above.
+	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
+
+	// Contention statistics, shown by the "lockstat" monitor command.
+	uint32_t nacquire;     // Acquisitions
+	uint32_t ncontended;   // Acquisitions that had to wait
+	uint64_t spin_cycles;  // TSC cycles spent waiting
+	struct spinlock *stat_next;	// Next lock in lockstat_list
+	bool stat_listed;      // On lockstat_list yet?
 #endif
 };
 
-void __spin_initlock(struct spinlock *lk, char *name);
+#ifdef DEBUG_SPINLOCK
+#define SPINLOCK_INIT(lock, r)	{ .name = #lock, .rank = (r) }
+#else
+#define SPINLOCK_INIT(lock, r)	{ 0 }
+#endif
+
+void __spin_initlock(struct spinlock *lk, char *name, int rank);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+void spin_lockstat(bool reset);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
-
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+#define spin_initlock(lock, rank)   __spin_initlock(lock, #lock, rank)
 
 #endif
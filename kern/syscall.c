@@ -56,7 +56,7 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = envid2env_locked(envid, &e, 1)) < 0)
 		return r;
 	/*if (e == curenv)
 		cprintf("[%08x] exiting gracefully\n", curenv->env_id);
@@ -66,6 +66,25 @@ sys_env_destroy(envid_t envid)
 	return 0;
 }
 
+// Look up two environments and lock them both (see env_lock_pair()).
+// They may be the same environment.
+static int
+envid2env_pair_locked(envid_t aid, struct Env **a, bool aperm,
+		      envid_t bid, struct Env **b, bool bperm)
+{
+	int r;
+
+	if ((r = envid2env(aid, a, aperm)) < 0 ||
+	    (r = envid2env(bid, b, bperm)) < 0)
+		return r;
+	env_lock_pair(*a, *b);
+	if (!env_alive(*a, aid) || !env_alive(*b, bid)) {
+		env_unlock_pair(*a, *b);
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -93,9 +112,11 @@ sys_exofork(void)
 		return ret_alloc;
 	}
 
+	env_lock(e);
 	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_tf = curenv->env_tf;
 	e->env_tf.tf_regs.reg_eax = 0;
+	env_unlock(e);
 	return e->env_id;
 }
 
@@ -117,16 +138,51 @@ sys_env_set_status(envid_t envid, int status)
 
 	// LAB 9: Your code here.
 	struct Env *e;
-	int r = envid2env(envid, &e, 1);
+
+	if(status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE) {
+		return -E_INVAL;
+	}
+
+	int r = envid2env_locked(envid, &e, 1);
 	if(r < 0){
 		return r;
 	}
 
-	if(status < 0 || status > 4) {
+	// sched_enqueue() leaves an env that some CPU still holds to
+	// that CPU, which requeues it when it lets go.
+	e->env_status = status;
+	if (status == ENV_RUNNABLE)
+		sched_enqueue(e);
+	env_unlock(e);
+	return 0;
+}
+
+// Restrict envid to the CPUs set in mask (bit i = CPU i).
+// A mask of 0 lets it run anywhere.  The env moves to an allowed
+// CPU the next time it is scheduled.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask names no CPU that exists.
+static int
+sys_env_set_cpumask(envid_t envid, uint32_t mask)
+{
+	struct Env *e;
+
+	if(mask && !(mask & ((1 << ncpu) - 1))) {
 		return -E_INVAL;
 	}
 
-	e->env_status = status;
+	int r = envid2env_locked(envid, &e, 1);
+	if(r < 0){
+		return r;
+	}
+
+	e->env_cpumask = mask;
+	if (e->env_status == ENV_RUNNABLE)
+		sched_enqueue(e);
+	env_unlock(e);
 	return 0;
 }
 
@@ -145,13 +201,15 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// address!
 	struct Env *env;
 
-	if (envid2env(envid, &env, true) != 0)
-		return -E_BAD_ENV;
+	// tf lives in the caller's address space
+	user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_W);
 
-	user_mem_assert(env, tf, sizeof(struct Trapframe), PTE_W);
+	if (envid2env_locked(envid, &env, true) != 0)
+		return -E_BAD_ENV;
 
 	env->env_tf = *tf;
 	env->env_tf.tf_eflags |= FL_IF;
+	env_unlock(env);
 	return 0;
 }
 
@@ -168,11 +226,12 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 {
 	// LAB 9: Your code here.
 	struct Env *env;
-	int r = envid2env(envid, &env, 1);
+	int r = envid2env_locked(envid, &env, 1);
 	if(r < 0){
 		return r;
 	}
 	env->env_pgfault_upcall = func;
+	env_unlock(env);
 	return 0;
 }
 
@@ -213,14 +272,22 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return r;
 	}
 
+	// Zero the page before taking the env lock
 	struct PageInfo *new_page = page_alloc(ALLOC_ZERO); 
 	if(!new_page){
 		return -E_NO_MEM;
 	}
-	r = page_insert(env->env_pgdir,new_page, va, perm);
+
+	env_lock(env);
+	if(!env_alive(env, envid)){
+		r = -E_BAD_ENV;
+	} else {
+		r = page_insert(env->env_pgdir,new_page, va, perm);
+	}
+	env_unlock(env);
 	if(r < 0){
 		page_free(new_page);
-		return -r;
+		return r;
 	}
 
 	return 0;
@@ -262,35 +329,26 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	}
 
-	int r = envid2env(srcenvid, &srcenv, 1);
-	if(r < 0){
-		return r;
+	if(!(perm & PTE_U)|| !(perm & PTE_P) || (perm | PTE_SYSCALL) != PTE_SYSCALL){
+		return -E_INVAL;
 	}
 
-	r = envid2env(dstenvid, &dstenv, 1);
+	int r = envid2env_pair_locked(srcenvid, &srcenv, 1, dstenvid, &dstenv, 1);
 	if(r < 0){
 		return r;
 	}
 
-	if(!(perm & PTE_U)|| !(perm & PTE_P) || (perm | PTE_SYSCALL) != PTE_SYSCALL){
-		return -E_INVAL;
-	}
-
 	struct PageInfo *srcpage = page_lookup(srcenv->env_pgdir, srcva, &pte_store);
-	if((perm & PTE_W) && !((*pte_store) & PTE_W)){
-			return -E_INVAL;
-	}
-
 	if(!srcpage){
-		return -E_INVAL;
-	}
-
-	r = page_insert(dstenv->env_pgdir, srcpage, dstva, perm);
-	if(r < 0){
-		return r;
+		r = -E_INVAL;
+	} else if((perm & PTE_W) && !((*pte_store) & PTE_W)){
+		r = -E_INVAL;
+	} else {
+		r = page_insert(dstenv->env_pgdir, srcpage, dstva, perm);
 	}
+	env_unlock_pair(srcenv, dstenv);
 
-	return 0;
+	return r < 0 ? r : 0;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -312,12 +370,13 @@ sys_page_unmap(envid_t envid, void *va)
 
 	struct Env *env;
 
-	int r = envid2env(envid,&env,1);
+	int r = envid2env_locked(envid,&env,1);
 	if(r < 0){
 		return r;
 	}
 
 	page_remove(env->env_pgdir, va);
+	env_unlock(env);
 
 	return 0;
 }
@@ -325,6 +384,9 @@ sys_page_unmap(envid_t envid, void *va)
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// If npages > 1, send the npages pages starting at 'srcva' instead;
+// as many of them as the receiver asked for are mapped, in order,
+// starting at its dstva.  npages == 0 means a single page.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -336,7 +398,8 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -352,6 +415,8 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
 //		or another environment managed to send first.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP and npages > IPC_MAXPAGES or the pages
+//		run past UTOP.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
@@ -361,46 +426,64 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm, int npages)
 {
 	// LAB 9: Your code here.
-	struct Env *env;
-	int r = envid2env(envid, &env, 0);
-	if(r < 0)
-		return r;
-	if(env->env_ipc_from)
-		return -E_IPC_NOT_RECV;
-	if(!env->env_ipc_recving){
-		return -E_IPC_NOT_RECV;
-	}
+	struct Env *env, *self;
+	struct PageInfo *pgs[IPC_MAXPAGES];
+	pte_t *pte;
+	int i, n = 0;
 
+	if (npages == 0)
+		npages = 1;
 	if((uint32_t)srcva < UTOP){
 		if((uint32_t)srcva % PGSIZE || !(perm & PTE_U) || !(perm & PTE_P) || (perm | PTE_SYSCALL) != PTE_SYSCALL){
 			return -E_INVAL;
 		}
-
-		pte_t *pte;
-		struct PageInfo *pg = page_lookup(curenv->env_pgdir, srcva, &pte);
-
-		if(!pg){
+		if (npages < 0 || npages > IPC_MAXPAGES
+		    || (uint32_t)srcva + npages * PGSIZE > UTOP)
 			return -E_INVAL;
-		}
+	}
 
-		if(perm & PTE_W && !(*pte & PTE_W)) {
-			return -E_INVAL;
+	int r = envid2env_pair_locked(0, &self, 0, envid, &env, 0);
+	if(r < 0)
+		return r;
+	if(env->env_ipc_from || !env->env_ipc_recving){
+		r = -E_IPC_NOT_RECV;
+		goto out;
+	}
+
+	if((uint32_t)srcva < UTOP){
+		// Check every page before mapping any
+		for (i = 0; i < npages; i++) {
+			pgs[i] = page_lookup(self->env_pgdir, (char *)srcva + i * PGSIZE, &pte);
+
+			if(!pgs[i]){
+				r = -E_INVAL;
+				goto out;
+			}
+
+			if(perm & PTE_W && !(*pte & PTE_W)) {
+				r = -E_INVAL;
+				goto out;
+			}
 		}
 
 		if ((uint32_t)(env->env_ipc_dstva) < UTOP){
-			r = page_insert(env->env_pgdir, pg, env->env_ipc_dstva, perm);
-			
-			if (r < 0)
-				return r;
+			n = MIN(npages, env->env_ipc_npages);
+			for (i = 0; i < n; i++) {
+				r = page_insert(env->env_pgdir, pgs[i],
+						(char *)env->env_ipc_dstva + i * PGSIZE, perm);
+				if (r < 0)
+					goto out;
+			}
 		}
 	}
 
 	env->env_ipc_recving = 0;
 	env->env_ipc_from = curenv->env_id;
 	env->env_ipc_value = value;
+	env->env_ipc_npages = n;
 
 	if((uint32_t)(env->env_ipc_dstva) < UTOP) {
 		env->env_ipc_perm = perm;	
@@ -409,10 +492,13 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	}
 
 	env->env_status = ENV_RUNNABLE;
-
 	env->env_tf.tf_regs.reg_eax = 0;
+	sched_enqueue(env);
+	r = 0;
 
-	return 0;
+out:
+	env_unlock_pair(self, env);
+	return r;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -421,29 +507,109 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// With npages > 1 you are willing to receive up to npages pages there;
+// npages == 0 means a single page.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP and npages > IPC_MAXPAGES or the pages
+//		run past UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, int npages)
 {
 	// LAB 9: Your code here.
+	if (npages == 0)
+		npages = 1;
 	if((uint32_t)dstva < UTOP && ((uint32_t)dstva) % PGSIZE){
 			return -E_INVAL;
 	}
+	if ((uint32_t)dstva < UTOP
+	    && (npages < 0 || npages > IPC_MAXPAGES
+		|| (uint32_t)dstva + npages * PGSIZE > UTOP))
+		return -E_INVAL;
 
+	env_lock(curenv);
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_npages = npages;
 	curenv->env_ipc_from = 0;
 
 	curenv->env_status = ENV_NOT_RUNNABLE;
+	env_unlock(curenv);
 
 	sched_yield();
 	return 0;
 }
 
+// Deliver hardware interrupt 'irq' to the calling environment.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if irq is not one a user driver may take over.
+//	-E_BAD_ENV if the caller is not the file system server.
+static int
+sys_irq_listen(int irq)
+{
+	return irq_listen(curenv, irq);
+}
+
+// Block until 'irq' has been raised since the previous sys_irq_wait
+// on it, much like sys_ipc_recv waits for a message.  Returns at once
+// if the interrupt is already pending.
+static int
+sys_irq_wait(int irq)
+{
+	if (irq < 0 || irq >= 16)
+		return -E_INVAL;
+
+	env_lock(curenv);
+	if (curenv->env_irq_pending & (1 << irq)) {
+		curenv->env_irq_pending &= ~(1 << irq);
+		env_unlock(curenv);
+		return 0;
+	}
+	curenv->env_irq_waiting = 1 << irq;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	env_unlock(curenv);
+
+	sched_yield();
+	return 0;
+}
+
+// Make envid share the caller's page tables for [va, va + size), so
+// that the pages mapped there are the same in both and stay the same
+// whenever either side maps or unmaps one.  va and size must be
+// multiples of PTSIZE, and envid must be a child of the caller with
+// nothing mapped in the range yet.  The file server shares its block
+// cache with its worker envs this way.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if the range is empty, misaligned or not below UTOP,
+//		if envid is the caller, or if envid already has a page
+//		table in the range.
+//	-E_NO_MEM if there's no memory to allocate a page table.
+static int
+sys_region_share(envid_t envid, void *va, size_t size)
+{
+	struct Env *self, *e;
+	uintptr_t start = (uintptr_t) va;
+	int r;
+
+	if (start % PTSIZE || size % PTSIZE || size == 0
+	    || start >= UTOP || size > UTOP - start)
+		return -E_INVAL;
+	if ((r = envid2env_pair_locked(0, &self, 1, envid, &e, 1)) < 0)
+		return r;
+	if (e == self)
+		r = -E_INVAL;
+	else
+		r = pgdir_share_range(self->env_pgdir, e->env_pgdir, start, size);
+	env_unlock_pair(self, e);
+	return r;
+}
+
 // Return date and time in UNIX timestamp format: seconds passed
 // from 1970-01-01 00:00:00 UTC.
 static int
@@ -532,9 +698,11 @@ sys_clock_nanosleep(int clock_id, int flags, const struct timespec *rqtp, struct
         tp = add_timespec(rqtp, &tp);
     }
 
+    env_lock(curenv);
     curenv->env_sleep_clockid = clock_id;
     curenv->env_wakeup_time = tp;
     curenv->env_status = ENV_SLEEPING;
+    env_unlock(curenv);
 
 	curenv->env_tf.tf_regs.reg_eax = 0;
 	if(rmtp){
@@ -596,11 +764,23 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
             res = sys_env_set_pgfault_upcall(a1,(void*)a2);
             break;
         case SYS_ipc_try_send:
-            res = sys_ipc_try_send(a1,a2,(void*)a3,a4);
+            res = sys_ipc_try_send(a1,a2,(void*)a3,a4,a5);
             break;
         case SYS_ipc_recv:
-            res = sys_ipc_recv((void*)a1);
+            res = sys_ipc_recv((void*)a1,a2);
+            break;
+        case SYS_env_set_cpumask:
+            res = sys_env_set_cpumask(a1,a2);
             break;
+		case SYS_irq_listen:
+			res = sys_irq_listen(a1);
+			break;
+		case SYS_irq_wait:
+			res = sys_irq_wait(a1);
+			break;
+		case SYS_region_share:
+			res = sys_region_share(a1, (void *) a2, a3);
+			break;
 		case SYS_gettime:
 			res = sys_gettime();
             break;
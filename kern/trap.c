@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 #include <inc/string.h>
 #include <inc/vsyscall.h>
 
@@ -15,8 +16,8 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/vsyscall.h>
-
-static struct Taskstate ts;
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -62,6 +63,8 @@ static const char *trapname(int trapno)
 		return excnames[trapno];
 	if (trapno == T_SYSCALL)
 		return "System call";
+	if (trapno == T_TLBFLUSH)
+		return "TLB shootdown";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
 	return "(unknown trap)";
@@ -91,6 +94,7 @@ trap_init(void)
 	extern void handler_simderr();
 	extern void handler_syscall();
 	extern void handler_pgflt();
+	extern void handler_tlbflush();
 
 	SETGATE(idt[T_DIVIDE], 0, GD_KT, handler_divide, 0);
 	SETGATE(idt[T_DEBUG], 0, GD_KT, handler_debug, 0);
@@ -111,6 +115,7 @@ trap_init(void)
 	SETGATE(idt[T_MCHK], 0, GD_KT, handler_mchk, 0);
 	SETGATE(idt[T_SIMDERR], 0, GD_KT, handler_simderr, 0);
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, handler_syscall, 3);
+	SETGATE(idt[T_TLBFLUSH], 0, GD_KT, handler_tlbflush, 0);
 
 
 	extern void handler_irq_timer();
@@ -136,22 +141,48 @@ trap_init(void)
 void
 trap_init_percpu(void)
 {
+	// Each CPU gets its own TSS, pointing at its own kernel stack
+	// (see mem_init_mp()), and its own TSS descriptor in the gdt:
+	// CPU i uses the descriptor at GD_TSS0 + (i << 3).
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+	int id = thiscpu->cpu_id;
+
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	ts->ts_esp0 = KSTACKTOP - id * (KSTKSIZE + KSTKGAP);
+	ts->ts_ss0 = GD_KD;
+	ts->ts_iomb = sizeof(struct Taskstate);
 
 	// Initialize the TSS slot of the gdt.
-	gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	gdt[(GD_TSS0 >> 3) + id] = SEG16(STS_T32A, (uint32_t) ts,
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS0 >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + id].sd_s = 0;
 
 	// Load the TSS selector (like other segment selectors, the
 	// bottom three bits are special; we leave them 0)
-	ltr(GD_TSS0);
+	ltr(GD_TSS0 + (id << 3));
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+#ifndef CONFIG_KSPACE
+	fpu_init_percpu();
+#endif
+
+#ifndef CONFIG_KSPACE
+	// SYSENTER enters sysenter_handler on the same stack as a trap.
+	// SYSEXIT derives the user segments from SYSENTER_CS, which
+	// relies on GD_KT, GD_KD, GD_UT and GD_UD being consecutive.
+	uint32_t edx;
+	extern void sysenter_handler();
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_FEAT_SEP) {
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, ts->ts_esp0);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
+#endif
 }
 
 
@@ -210,6 +241,60 @@ print_regs(struct PushRegs *regs)
 }
 
 
+// Device IRQs that a user-level driver may take over; the rest belong
+// to the kernel.
+#define IRQ_USER_MASK	(1 << IRQ_IDE)
+
+// Env that receives each user IRQ, or 0.
+static envid_t irq_env[16];
+static struct spinlock irq_lock = SPINLOCK_INIT(irq_lock, LOCK_IRQ);
+
+// Route hardware interrupt 'irq' to e and unmask it.  Only the file
+// system server drives hardware, so only it and its worker envs (its
+// children) may listen; a worker takes the IRQ over before each disk
+// transfer it starts.
+int
+irq_listen(struct Env *e, int irq)
+{
+	struct Env *parent;
+
+	if (irq < 0 || irq >= 16 || !(IRQ_USER_MASK & (1 << irq)))
+		return -E_INVAL;
+	if (e->env_type != ENV_TYPE_FS
+	    && (envid2env(e->env_parent_id, &parent, 0) < 0
+		|| parent->env_type != ENV_TYPE_FS))
+		return -E_BAD_ENV;
+
+	spin_lock(&irq_lock);
+	irq_env[irq] = e->env_id;
+	if (irq_mask_8259A & (1 << irq))
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	spin_unlock(&irq_lock);
+	return 0;
+}
+
+// Record a user IRQ in its listener and wake it if it is blocked in
+// sys_irq_wait.  Interrupts raised while nobody waits stay pending, so
+// a driver cannot miss one that fires before it goes to sleep.
+static void
+irq_notify(int irq)
+{
+	struct Env *e;
+	envid_t id = irq_env[irq];
+
+	if (!id || envid2env_locked(id, &e, 0) < 0)
+		return;
+	e->env_irq_pending |= 1 << irq;
+	if (e->env_irq_waiting & e->env_irq_pending) {
+		e->env_irq_pending &= ~e->env_irq_waiting;
+		e->env_irq_waiting = 0;
+		e->env_tf.tf_regs.reg_eax = 0;
+		e->env_status = ENV_RUNNABLE;
+		sched_enqueue(e);
+	}
+	env_unlock(e);
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -223,6 +308,11 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	if(tf->tf_trapno == T_DEVICE && (tf->tf_cs & 3) == 3){
+		fpu_trap();
+		return;
+	}
+
 	if(tf->tf_trapno == T_BRKPT){
 		monitor(tf);		
 	} 
@@ -237,6 +327,21 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Another CPU changed a shared page table
+	if (tf->tf_trapno == T_TLBFLUSH) {
+		lapic_eoi();
+		tlb_shootdown_poll();
+		return;
+	}
+
+	// Handle the per-CPU LAPIC timer: every CPU, not just the one
+	// wired to the RTC, gets preempted.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
+		lapic_eoi();
+		sched_yield();
+		return;
+	}
+
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_CLOCK) {
 		rtc_check_status();
 		pic_send_eoi(IRQ_CLOCK);
@@ -258,10 +363,17 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_IDE) {
+		pic_send_eoi(IRQ_IDE);
+		irq_notify(IRQ_IDE);
+		return;
+	}
+
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT) {
 		panic("unhandled trap in kernel");
 	} else {
+		env_lock(curenv);
 		env_destroy(curenv);
 	}
 }
@@ -283,24 +395,32 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
-	//cprintf("Incoming TRAP frame at %p\n", tf);
+	// We may have been halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 
-	assert(curenv);
+	//cprintf("Incoming TRAP frame at %p\n", tf);
 
-	// Garbage collect if current enviroment is a zombie
-	if (curenv->env_status == ENV_DYING) {
-		env_free(curenv);
-		curenv = NULL;
-		sched_yield();
+#ifdef CONFIG_KSPACE
+	if (curenv) {
+#else
+	if ((tf->tf_cs & 3) == 3) {
+		// Trapped from user mode.
+#endif
+		assert(curenv);
+
+		// Garbage collect if current enviroment is a zombie:
+		// sched_yield() frees it when letting go of it.
+		if (curenv->env_status == ENV_DYING)
+			sched_yield();
+
+		// Copy trap frame (which is currently on the stack)
+		// into 'curenv->env_tf', so that running the environment
+		// will restart at the trap point.
+		curenv->env_tf = *tf;
+		// The trapframe on the stack should be ignored from here on.
+		tf = &curenv->env_tf;
 	}
 
-	// Copy trap frame (which is currently on the stack)
-	// into 'curenv->env_tf', so that running the environment
-	// will restart at the trap point.
-	curenv->env_tf = *tf;
-	// The trapframe on the stack should be ignored from here on.
-	tf = &curenv->env_tf;
-
 	// Record that tf is the last real trapframe so
 	// print_trapframe can print some additional information.
 	last_tf = tf;
@@ -317,6 +437,35 @@ trap(struct Trapframe *tf)
 		sched_yield();
 }
 
+// The SYSENTER fast path: sysenter_handler in trapentry.S has built
+// tf on the kernel stack.  Returns the frame to resume with SYSEXIT,
+// unless some other environment gets to run instead.
+struct Trapframe *
+sysenter_trap(struct Trapframe *tf)
+{
+	asm volatile("cld" ::: "cc");
+
+	assert(curenv);
+	if (curenv->env_status == ENV_DYING)
+		sched_yield();
+
+	// As in trap(), resuming through env_run() must work too.
+	curenv->env_tf = *tf;
+	tf = &curenv->env_tf;
+	last_tf = tf;
+
+	// Only four arguments fit; SI carried the return address.
+	tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
+				      tf->tf_regs.reg_edx,
+				      tf->tf_regs.reg_ecx,
+				      tf->tf_regs.reg_ebx,
+				      tf->tf_regs.reg_edi, 0);
+
+	if (curenv && curenv->env_status == ENV_RUNNING)
+		return tf;
+	sched_yield();
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
@@ -398,5 +547,6 @@ page_fault_handler(struct Trapframe *tf)
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	env_lock(curenv);
 	env_destroy(curenv);
 }
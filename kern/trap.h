@@ -8,6 +8,7 @@
 
 #include <inc/trap.h>
 #include <inc/mmu.h>
+#include <inc/env.h>
 
 /* The kernel's interrupt descriptor table */
 extern struct Gatedesc idt[];
@@ -19,6 +20,8 @@ void trap_init_percpu(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
+struct Trapframe *sysenter_trap(struct Trapframe *tf);
+int irq_listen(struct Env *e, int irq);
 void backtrace(struct Trapframe *);
 
 #endif /* JOS_KERN_TRAP_H */
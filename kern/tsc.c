@@ -3,9 +3,13 @@
 #include <inc/x86.h>
 #include <inc/stdio.h>
 
+#include <inc/vsyscall.h>
+
 #include <kern/tsc.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/spinlock.h>
+#include <kern/vsyscall.h>
 
 /* The clock frequency of the i8253/i8254 PIT */
 #define PIT_TICK_RATE 1193182ul
@@ -19,6 +23,15 @@ struct timespec realtime_start;
 struct timespec resol;
 
 unsigned long cpu_freq;
+
+// Fixed-point TSC conversions, as Linux clocksource does them:
+// ns = (cycles * tsc_mult) >> tsc_shift, and back with cyc_mult and
+// cyc_shift.  Set up by tsc_calibrate().
+uint32_t tsc_mult, tsc_shift;
+static uint32_t cyc_mult, cyc_shift;
+
+// Serializes clock_publish() writers.
+static struct spinlock clock_lock = SPINLOCK_INIT(clock_lock, LOCK_CLOCK);
 /*
  * This reads the current MSB of the PIT counter, and
  * checks if we are running on sufficiently fast and
@@ -171,6 +184,30 @@ success:
 	return delta;
 }
 
+/*
+ * Pick mult and shift so that (x * mult) >> shift converts from a
+ * rate of 'from' per second to 'to' per second with the most precision
+ * a 32-bit mult allows.  mul_u64_u32_shr() keeps the whole product, so
+ * unlike Linux we need not bound the range of x.  The divisions here
+ * only run at calibration time.  Shifts that would push bits of 'to'
+ * out of 64 bits (a TSC over 2^32 Hz) are skipped.
+ */
+static void calc_mult_shift(uint32_t *mult, uint32_t *shift, uint64_t from, uint64_t to)
+{
+	uint64_t tmp = 0;
+	uint32_t sft;
+
+	for (sft = 32; sft > 0; sft--) {
+		if (to >> (64 - sft))
+			continue;
+		tmp = ((to << sft) + from / 2) / from;
+		if (!(tmp >> 32))
+			break;
+	}
+	*mult = tmp;
+	*shift = sft;
+}
+
 void tsc_calibrate(void)
 {
     int i;
@@ -186,6 +223,19 @@ void tsc_calibrate(void)
     cprintf("Detected %lu.%03lu MHz processor.\n",
 		(unsigned long)cpu_freq / 1000,
 		(unsigned long)cpu_freq % 1000);
+
+	calc_mult_shift(&tsc_mult, &tsc_shift, cpu_freq * 1000ULL, NSEC_PER_SEC);
+	calc_mult_shift(&cyc_mult, &cyc_shift, NSEC_PER_SEC, cpu_freq * 1000ULL);
+}
+
+static uint64_t cycles_to_ns(uint64_t cycles)
+{
+	return mul_u64_u32_shr(cycles, tsc_mult, tsc_shift);
+}
+
+static uint64_t ns_to_cycles(uint64_t ns)
+{
+	return mul_u64_u32_shr(ns, cyc_mult, cyc_shift);
 }
 
 void print_time(unsigned seconds)
@@ -234,6 +284,28 @@ void clock_init(void)
 	cprintf("clock resolution: %d s %ld ns\n", resol.tv_sec, resol.tv_nsec);
 }
 
+// Copy the clock parameters into the vsys page, so that user
+// environments can read CLOCK_MONOTONIC and CLOCK_REALTIME without a
+// system call.  Needs vsys, so it is first called after mem_init().
+void clock_publish(void)
+{
+	spin_lock(&clock_lock);
+	vsys[VSYS_clock_gen]++;
+	asm volatile("" ::: "memory");
+
+	vsys[VSYS_cpu_freq] = cpu_freq;
+	vsys[VSYS_tsc_mult] = tsc_mult;
+	vsys[VSYS_tsc_shift] = tsc_shift;
+	vsys[VSYS_mono_start_lo] = (uint32_t) mono_start;
+	vsys[VSYS_mono_start_hi] = (uint32_t) (mono_start >> 32);
+	vsys[VSYS_realtime_sec] = realtime_start.tv_sec;
+	vsys[VSYS_realtime_nsec] = realtime_start.tv_nsec;
+
+	asm volatile("" ::: "memory");
+	vsys[VSYS_clock_gen]++;
+	spin_unlock(&clock_lock);
+}
+
 void clock_getres(int clock_id, struct timespec *res)
 {
 	*res = resol;
@@ -250,26 +322,23 @@ void clock_getres(int clock_id, struct timespec *res)
 // регистра TSC и curenv->env_cputime_start, переведённую в секунды и наносекунды
 void clock_gettime(int clock_id, struct timespec *tp)
 {
-	uint64_t tme = 0;
-	tp->tv_sec = 0;
-	tp->tv_nsec = 0;
-	switch(clock_id)
-	{
-		case CLOCK_REALTIME:
-			*tp = realtime_start;
-		case CLOCK_MONOTONIC:
-			tme = read_tsc() - mono_start;
-			break;
-		case CLOCK_PROCESS_CPUTIME_ID:
-			tme = curenv->env_cputime + (read_tsc() - curenv->env_cputime_start);
-			break;
-	}
-	struct timespec tme1;
+	if (clock_id == CLOCK_PROCESS_CPUTIME_ID)
+		*tp = ns_to_timespec(cycles_to_ns(curenv->env_cputime +
+					(read_tsc() - curenv->env_cputime_start)));
+	else
+		*tp = ns_to_timespec(clock_ns(clock_id));
+}
 
-	tme1.tv_sec = tme / cpu_freq / 1000;
-	tme1.tv_nsec = (tme % (cpu_freq * 1000)) * 1000000 / cpu_freq;
+// Nanoseconds on CLOCK_MONOTONIC or CLOCK_REALTIME, without the
+// division a struct timespec needs; sched_yield() compares sleep
+// deadlines in this form.
+int64_t clock_ns(int clock_id)
+{
+	int64_t ns = cycles_to_ns(read_tsc() - mono_start);
 
-	*tp = add_timespec(tp, &tme1);
+	if (clock_id == CLOCK_REALTIME)
+		ns += timespec_to_ns(&realtime_start);
+	return ns;
 }
 
 // clock_settime в зависимости от типа:
@@ -287,13 +356,12 @@ int clock_settime(int clock_id, const struct timespec *tp)
 	switch(clock_id)
 	{
 		case CLOCK_REALTIME:
-			tme = read_tsc() - mono_start;
-			tme1.tv_sec = tme / cpu_freq / 1000;
-			tme1.tv_nsec = (tme % (cpu_freq * 1000)) * 1000000 / cpu_freq;
+			tme1 = ns_to_timespec(cycles_to_ns(read_tsc() - mono_start));
 			realtime_start = sub_timespec(tp, &tme1);
+			clock_publish();
 			break;
 		case CLOCK_PROCESS_CPUTIME_ID:
-			tme = tp->tv_sec * cpu_freq * 1000 + tp->tv_nsec * cpu_freq / 1000000;
+			tme = ns_to_cycles(timespec_to_ns(tp));
 			curenv->env_cputime = tme - (read_tsc() - curenv->env_cputime_start);
 			break;
 	}
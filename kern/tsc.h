@@ -8,13 +8,18 @@
 
 #include <inc/time.h>
 
+// TSC frequency in kHz, set by tsc_calibrate
+extern unsigned long cpu_freq;
+
 void tsc_calibrate(void);
 void timer_start(void);
 void timer_stop(void);
 void clock_init(void);
+void clock_publish(void);
 
 void clock_getres(int clock_id, struct timespec *res);
 void clock_gettime(int clock_id, struct timespec *tp);
+int64_t clock_ns(int clock_id);
 int clock_settime(int clock_id, const struct timespec *tp);
 
 #endif	// !JOS_KERN_TSC_H
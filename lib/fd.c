@@ -102,15 +102,18 @@ fd_close(struct Fd *fd, bool must_exist)
 {
 	struct Fd *fd2;
 	struct Dev *dev;
-	int r;
+	int r, r2;
 	if ((r = fd_lookup(fd2num(fd), &fd2)) < 0
 	    || fd != fd2)
 		return (must_exist ? r : 0);
 	if ((r = dev_lookup(fd->fd_dev_id, &dev)) >= 0) {
-		if (dev->dev_close)
-			r = (*dev->dev_close)(fd);
-		else
-			r = 0;
+		// A failed flush is reported, but the fd is closed anyway
+		r = fdbuf_flush(fd);
+		if (dev->dev_close && (r2 = (*dev->dev_close)(fd)) < 0 && r == 0)
+			r = r2;
+		// A buffered file keeps its buffer in the data page
+		if (dev == &devfile)
+			(void) sys_page_unmap(0, fd2data(fd));
 	}
 	// Make sure fd is unmapped.  Might be a no-op if
 	// (*dev->dev_close)(fd) already unmapped it.
@@ -165,6 +168,19 @@ close_all(void)
 		close(i);
 }
 
+// Flush every buffered file descriptor, before the descriptor table is
+// shared with a child environment.
+void
+fdbuf_flush_all(void)
+{
+	struct Fd *fd;
+	int i;
+
+	for (i = 0; i < MAXFD; i++)
+		if (fd_lookup(i, &fd) == 0)
+			fdbuf_flush(fd);
+}
+
 // Make file descriptor 'newfdnum' a duplicate of file descriptor 'oldfdnum'.
 // For instance, writing onto either file descriptor will affect the
 // file and the file offset of the other.
@@ -215,6 +231,8 @@ read(int fdnum, void *buf, size_t n)
 	}
 	if (!dev->dev_read)
 		return -E_NOT_SUPP;
+	if ((r = fdbuf_read(fd, dev, buf, n)) != -E_NOT_SUPP)
+		return r;
 	return (*dev->dev_read)(fd, buf, n);
 }
 
@@ -236,7 +254,7 @@ readn(int fdnum, void *buf, size_t n)
 ssize_t
 write(int fdnum, const void *buf, size_t n)
 {
-	int r;
+	int r, tot;
 	struct Dev *dev;
 	struct Fd *fd;
 
@@ -252,7 +270,19 @@ write(int fdnum, const void *buf, size_t n)
 			fdnum, buf, n, dev->dev_name);
 	if (!dev->dev_write)
 		return -E_NOT_SUPP;
-	return (*dev->dev_write)(fd, buf, n);
+
+	// Devices may write less than asked for; the file device takes
+	// large buffers in as few requests as it can.
+	for (tot = 0; tot < n; tot += r) {
+		r = fdbuf_write(fd, dev, (const char*)buf + tot, n - tot);
+		if (r == -E_NOT_SUPP)
+			r = (*dev->dev_write)(fd, (const char*)buf + tot, n - tot);
+		if (r < 0)
+			return tot ? tot : r;
+		if (r == 0)
+			break;
+	}
+	return tot;
 }
 
 int
@@ -263,10 +293,31 @@ seek(int fdnum, off_t offset)
 
 	if ((r = fd_lookup(fdnum, &fd)) < 0)
 		return r;
+	if ((r = fdbuf_flush(fd)) < 0)
+		return r;
 	fd->fd_offset = offset;
 	return 0;
 }
 
+// Write out fdnum's buffer, if it has one, and ask the device to make
+// the file's contents durable.
+int
+fsync(int fdnum)
+{
+	int r;
+	struct Dev *dev;
+	struct Fd *fd;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0
+	    || (r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+		return r;
+	if ((r = fdbuf_flush(fd)) < 0)
+		return r;
+	if (!dev->dev_sync)
+		return 0;
+	return (*dev->dev_sync)(fd);
+}
+
 int
 ftruncate(int fdnum, off_t newsize)
 {
@@ -283,6 +334,8 @@ ftruncate(int fdnum, off_t newsize)
 	}
 	if (!dev->dev_trunc)
 		return -E_NOT_SUPP;
+	if ((r = fdbuf_flush(fd)) < 0)
+		return r;
 	return (*dev->dev_trunc)(fd, newsize);
 }
 
@@ -298,6 +351,8 @@ fstat(int fdnum, struct Stat *stat)
 		return r;
 	if (!dev->dev_stat)
 		return -E_NOT_SUPP;
+	if ((r = fdbuf_flush(fd)) < 0)
+		return r;
 	stat->st_name[0] = 0;
 	stat->st_size = 0;
 	stat->st_isdir = 0;
@@ -0,0 +1,138 @@
+// Buffered file descriptors.
+//
+// A file opened with O_BUFFERED gets a buffer in its fd's data page
+// (fd2data), which file descriptors otherwise leave unused.  Reads
+// fill the buffer a page at a time and are served from it; writes are
+// collected in it and sent to the file server when it fills up.  So a
+// run of small reads or writes costs one file server request per
+// buffer instead of one per call.
+//
+// The buffer is private to this environment: the data page is not
+// PTE_SHARE, so a spawned child's copy of the fd is unbuffered, and a
+// forked child gets a copy of the buffer.  fork and spawn therefore
+// flush every buffer first.
+//
+// The fd's offset, shared with the file server, is kept at the end of
+// the buffered read data or at the start of the buffered write data;
+// flushing a read buffer moves it back to where the reader is.
+
+#include <inc/lib.h>
+
+enum {
+	FB_IDLE = 0,	// Buffer is empty
+	FB_READ,	// Holds data read ahead
+	FB_WRITE,	// Holds data not yet written
+};
+
+struct FdBuf {
+	int fb_mode;
+	int fb_len;		// Bytes of data in fb_data
+	int fb_pos;		// Next byte to read, in FB_READ mode
+	char fb_data[PGSIZE - 3 * sizeof(int)];
+};
+
+// Return fd's buffer, or NULL if fd is not buffered.
+static struct FdBuf *
+fdbuf_lookup(struct Fd *fd)
+{
+	char *va = fd2data(fd);
+
+	if (fd->fd_dev_id != devfile.dev_id
+	    || !(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P))
+		return NULL;
+	return (struct FdBuf *) va;
+}
+
+// Buffer fd from now on.  Returns 0 on success, < 0 on error.
+int
+fdbuf_enable(struct Fd *fd)
+{
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (fdbuf_lookup(fd))
+		return 0;
+	return sys_page_alloc(0, fd2data(fd), PTE_P|PTE_U|PTE_W);
+}
+
+// Write out or give back whatever fd's buffer holds.
+// Returns 0 on success, < 0 on error.
+int
+fdbuf_flush(struct Fd *fd)
+{
+	struct FdBuf *b;
+	struct Dev *dev;
+	int r, off;
+
+	if (!(b = fdbuf_lookup(fd)))
+		return 0;
+
+	if (b->fb_mode == FB_READ)
+		fd->fd_offset -= b->fb_len - b->fb_pos;
+	else if (b->fb_mode == FB_WRITE) {
+		if ((r = dev_lookup(fd->fd_dev_id, &dev)) < 0)
+			return r;
+		for (off = 0; off < b->fb_len; off += r) {
+			r = (*dev->dev_write)(fd, b->fb_data + off, b->fb_len - off);
+			if (r < 0)
+				return r;
+			if (r == 0)
+				return -E_NO_DISK;
+		}
+	}
+	b->fb_mode = FB_IDLE;
+	b->fb_len = b->fb_pos = 0;
+	return 0;
+}
+
+// Read from fd through its buffer; like dev_read, may read less than
+// n bytes.  Returns -E_NOT_SUPP if fd is not buffered.
+ssize_t
+fdbuf_read(struct Fd *fd, struct Dev *dev, void *buf, size_t n)
+{
+	struct FdBuf *b;
+	int r;
+
+	if (!(b = fdbuf_lookup(fd)))
+		return -E_NOT_SUPP;
+	if (b->fb_mode != FB_READ || b->fb_pos == b->fb_len) {
+		if ((r = fdbuf_flush(fd)) < 0)
+			return r;
+		// Large reads gain nothing from the buffer
+		if (n >= sizeof(b->fb_data))
+			return (*dev->dev_read)(fd, buf, n);
+		if ((r = (*dev->dev_read)(fd, b->fb_data, sizeof(b->fb_data))) <= 0)
+			return r;
+		b->fb_mode = FB_READ;
+		b->fb_len = r;
+	}
+
+	n = MIN(n, b->fb_len - b->fb_pos);
+	memmove(buf, b->fb_data + b->fb_pos, n);
+	b->fb_pos += n;
+	return n;
+}
+
+// Write to fd through its buffer; like dev_write, may write less than
+// n bytes.  Returns -E_NOT_SUPP if fd is not buffered.
+ssize_t
+fdbuf_write(struct Fd *fd, struct Dev *dev, const void *buf, size_t n)
+{
+	struct FdBuf *b;
+	int r;
+
+	if (!(b = fdbuf_lookup(fd)))
+		return -E_NOT_SUPP;
+	if (b->fb_mode == FB_READ
+	    || b->fb_len + n > sizeof(b->fb_data))
+		if ((r = fdbuf_flush(fd)) < 0)
+			return r;
+
+	// Large writes go straight through, once the buffer is empty
+	if (n >= sizeof(b->fb_data))
+		return (*dev->dev_write)(fd, buf, n);
+
+	memmove(b->fb_data + b->fb_len, buf, n);
+	b->fb_len += n;
+	b->fb_mode = FB_WRITE;
+	return n;
+}
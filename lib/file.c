@@ -6,6 +6,14 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Window for FSREQ_READV and FSREQ_WRITEV: the request, followed by up
+// to FSIPC_MAXPAGES pages of data.  Pages are mapped on first use.
+#define FSBULKVA	0xCE000000
+#define fsbulkbuf	(*(union Fsipc *) FSBULKVA)
+#define fsbulkdata	((char *) FSBULKVA + PGSIZE)
+
+static envid_t fsenv;
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,7 +23,6 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
@@ -28,7 +35,39 @@ fsipc(unsigned type, void *dstva)
 	return ipc_recv(NULL, dstva, NULL);
 }
 
-static int devfile_flush(struct Fd *fd);
+// Make the request page and the first npages data pages of the bulk
+// window present and writable.  A page shared copy-on-write with a
+// parent or child is written to, so that it gets copied.
+static int
+fsbulk_map(int npages)
+{
+	char *va;
+	int r;
+
+	for (va = (char *) FSBULKVA; va < fsbulkdata + npages * PGSIZE; va += PGSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P)) {
+			if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+				return r;
+		} else if (!(uvpt[PGNUM(va)] & PTE_W))
+			*(volatile char *) va = *(volatile char *) va;
+	}
+	return 0;
+}
+
+// Send the request in fsbulkbuf, along with npages data pages, and
+// wait for the reply.  Returns result from the file server.
+static int
+fsipc_bulk(unsigned type, int npages)
+{
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	ipc_send_pages(fsenv, type, &fsbulkbuf, 1 + npages, PTE_P | PTE_W | PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+static int devfile_close(struct Fd *fd);
+static int devfile_sync(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
@@ -39,10 +78,11 @@ struct Dev devfile =
 	.dev_id =	'f',
 	.dev_name =	"file",
 	.dev_read =	devfile_read,
-	.dev_close =	devfile_flush,
+	.dev_close =	devfile_close,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
-	.dev_trunc =	devfile_trunc
+	.dev_trunc =	devfile_trunc,
+	.dev_sync =	devfile_sync
 };
 
 // Open a file (or directory).
@@ -84,26 +124,87 @@ open(const char *path, int mode)
 		fd_close(fd, 0);
 		return r;
 	}
+	if ((mode & O_BUFFERED) && (r = fdbuf_enable(fd)) < 0) {
+		fd_close(fd, 0);
+		return r;
+	}
 
 	return fd2num(fd);
 }
 
+// Flush the file descriptor and tell the server whether the client is
+// closing it.
+static int
+devfile_flush(struct Fd *fd, bool close)
+{
+	fsipcbuf.flush.req_fileid = fd->fd_file.id;
+	fsipcbuf.flush.req_close = close;
+	return fsipc(FSREQ_FLUSH, NULL);
+}
+
 // Flush the file descriptor.  After this the fileid is invalid.
 //
 // This function is called by fd_close.  fd_close will take care of
 // unmapping the FD page from this environment.  Since the server uses
 // the reference counts on the FD pages to detect which files are
-// open, unmapping it is enough to free up server-side resources.
-// Other than that, we just have to make sure our changes are flushed
-// to disk.
+// open, unmapping it is enough to free up server-side resources; the
+// flush request also tells the server to look at this file's slot
+// first when it next needs one.  Other than that, we just have to make
+// sure our changes are flushed to disk.
 static int
-devfile_flush(struct Fd *fd)
+devfile_close(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	return devfile_flush(fd, 1);
+}
+
+// Flush the file descriptor for fsync.  The file stays open.
+static int
+devfile_sync(struct Fd *fd)
+{
+	return devfile_flush(fd, 0);
+}
+
+// Read at most FSIPC_MAXPAGES pages' worth of 'n' bytes with a single
+// FSREQ_READV request.
+static ssize_t
+devfile_readv(struct Fd *fd, void *buf, size_t n)
+{
+	int npages, r;
+
+	n = MIN(n, FSIPC_MAXPAGES * PGSIZE);
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+	if ((r = fsbulk_map(npages)) < 0)
+		return r;
+
+	fsbulkbuf.readv.req_fileid = fd->fd_file.id;
+	fsbulkbuf.readv.req_n = n;
+	if ((r = fsipc_bulk(FSREQ_READV, npages)) < 0)
+		return r;
+	assert(r <= n);
+	memmove(buf, fsbulkdata, r);
+	return r;
+}
+
+// Write at most FSIPC_MAXPAGES pages' worth of 'n' bytes with a single
+// FSREQ_WRITEV request.
+static ssize_t
+devfile_writev(struct Fd *fd, const void *buf, size_t n)
+{
+	int npages, r;
+
+	n = MIN(n, FSIPC_MAXPAGES * PGSIZE);
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+	if ((r = fsbulk_map(npages)) < 0)
+		return r;
+
+	fsbulkbuf.writev.req_fileid = fd->fd_file.id;
+	fsbulkbuf.writev.req_n = n;
+	memmove(fsbulkdata, buf, n);
+	return fsipc_bulk(FSREQ_WRITEV, npages);
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
+// Requests of more than a page go to devfile_readv.
 //
 // Returns:
 // 	The number of bytes successfully read.
@@ -117,6 +218,9 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (n > PGSIZE)
+		return devfile_readv(fd, buf, n);
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -129,6 +233,7 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 
 
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
+// Requests of more than a page go to devfile_writev.
 //
 // Returns:
 //	 The number of bytes successfully written.
@@ -142,6 +247,8 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 10: Your code here
 	uint32_t max_write = PGSIZE - (sizeof(int) + sizeof(size_t));
+	if (n > PGSIZE)
+		return devfile_writev(fd, buf, n);
 	if (n > max_write){
 		n = max_write;
 	}
@@ -176,6 +283,15 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 	return fsipc(FSREQ_SET_SIZE, NULL);
 }
 
+// Delete a file
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
 
 // Synchronize disk with buffer cache
 int
@@ -187,3 +303,16 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Get the file server's block cache counters.  If limit is not 0,
+// first limit the cache to that many blocks.
+int
+fscachestat(uint32_t limit, struct Fscachestat *st)
+{
+	int r;
+
+	fsipcbuf.cachestat.req_limit = limit;
+	if ((r = fsipc(FSREQ_CACHESTAT, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.cachestatRet;
+	return 0;
+}
@@ -46,7 +46,7 @@ pgfault(struct UTrapframe *utf)
 		panic("sys_page_alloc: %i", r);
 	}
 
-	memmove((void*)PFTEMP, rnd_addr, PGSIZE);
+	page_copy((void*)PFTEMP, rnd_addr);
 
 	r = sys_page_map(0, (void*)PFTEMP, 0, rnd_addr, PTE_P|PTE_U|PTE_W);
 
@@ -136,6 +136,8 @@ fork(void)
 	// LAB 9: Your code here.
 	envid_t envid;
 	set_pgfault_handler(pgfault);	
+	// The child must not inherit buffered file data (lib/fdbuf.c)
+	fdbuf_flush_all();
 	envid = sys_exofork();
 	if(envid < 0) {
 		panic("exofork error\n");
@@ -0,0 +1,178 @@
+// Asynchronous file I/O.
+//
+// An environment that uses these calls shares a ring page and
+// FSRING_NSLOTS data pages with the file server (inc/fs.h), set up on
+// first use.  fsring_read and fsring_write queue a request on the ring,
+// taking a data page for it, and return the request's tag at once.
+// fsring_submit rings the server's doorbell, a one-way IPC, for all
+// the requests queued since the last one; the server then serves them
+// while the client goes on computing, and posts a completion for each.
+// fsring_wait collects completions.  So up to FSRING_NSLOTS reads and
+// writes can be in flight, and a batch of them costs one IPC.
+//
+// Requests name their file offset, like pread and pwrite, and leave
+// the seek position alone.  Each moves at most a page.
+//
+// A forked or spawned child maps the parent's ring pages (they are
+// PTE_SHARE) but sets up a ring of its own on first use.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define FSRINGVA	0xCC000000
+#define fsring		(*(struct Fsring *) FSRINGVA)
+#define fsring_data(slot)	((char *) FSRINGVA + (1 + (slot)) * PGSIZE)
+
+static envid_t fsenv;
+static envid_t ring_env;	// The env that set up the ring, if any
+
+static uint32_t sq_tail;	// Next submission queue entry to fill
+static uint32_t sq_rung;	// sq_tail at the last doorbell
+static uint32_t cq_head;	// Next completion to collect
+
+// Free data slots, and where each read in flight delivers its data
+static uint32_t slot_free[FSRING_NSLOTS];
+static int nfree;
+static void *slot_buf[FSRING_NSLOTS];
+
+// Set up this env's ring, unless it has one.
+// Returns 0 on success, < 0 on error.
+static int
+fsring_init(void)
+{
+	char *va;
+	int r;
+
+	if (ring_env == thisenv->env_id)
+		return 0;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	for (va = (char *) FSRINGVA; va < fsring_data(FSRING_NSLOTS); va += PGSIZE)
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			return r;
+	ipc_send_pages(fsenv, FSREQ_RING_SETUP, &fsring, 1 + FSRING_NSLOTS,
+		       PTE_P|PTE_U|PTE_W);
+	if ((r = ipc_recv(NULL, NULL, NULL)) < 0)
+		return r;
+
+	sq_tail = sq_rung = cq_head = 0;
+	for (nfree = 0; nfree < FSRING_NSLOTS; nfree++)
+		slot_free[nfree] = FSRING_NSLOTS - 1 - nfree;
+	ring_env = thisenv->env_id;
+	return 0;
+}
+
+// Queue request op of n bytes at offset in fdnum's file.  Returns the
+// request's tag, < 0 on error.
+static int
+fsring_queue(uint32_t op, int fdnum, size_t n, off_t offset)
+{
+	struct Fsring_sqe *sqe;
+	struct Fd *fd;
+	uint32_t slot;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((fd->fd_omode & O_ACCMODE) == (op == FSRING_READ ? O_WRONLY : O_RDONLY))
+		return -E_INVAL;
+	if (n > PGSIZE || offset < 0)
+		return -E_INVAL;
+	// Data this env buffers is not on the server yet
+	if ((r = fdbuf_flush(fd)) < 0)
+		return r;
+	if ((r = fsring_init()) < 0)
+		return r;
+	if (nfree == 0)
+		return -E_NO_MEM;
+
+	slot = slot_free[--nfree];
+	sqe = &fsring.r_sq[sq_tail % FSRING_NSLOTS];
+	sqe->sqe_op = op;
+	sqe->sqe_fileid = fd->fd_file.id;
+	sqe->sqe_slot = slot;
+	sqe->sqe_n = n;
+	sqe->sqe_offset = offset;
+	slot_buf[slot] = NULL;
+	return slot;
+}
+
+// Make the entry fsring_queue filled visible to the server.
+static void
+fsring_publish(void)
+{
+	barrier();
+	fsring.r_sq_tail = ++sq_tail;
+}
+
+// Queue a read of up to n bytes (at most a page) at offset in fdnum
+// into buf.  buf is filled in when fsring_wait collects the request.
+// Returns the request's tag, or < 0 on error: -E_NO_MEM if
+// FSRING_NSLOTS requests are already in flight.
+int
+fsring_read(int fdnum, void *buf, size_t n, off_t offset)
+{
+	int tag;
+
+	if ((tag = fsring_queue(FSRING_READ, fdnum, n, offset)) < 0)
+		return tag;
+	slot_buf[tag] = buf;
+	fsring_publish();
+	return tag;
+}
+
+// Queue a write of n bytes (at most a page) from buf at offset in
+// fdnum, like fsring_read.  buf may be reused as soon as this returns.
+int
+fsring_write(int fdnum, const void *buf, size_t n, off_t offset)
+{
+	int tag;
+
+	if ((tag = fsring_queue(FSRING_WRITE, fdnum, n, offset)) < 0)
+		return tag;
+	memmove(fsring_data(tag), buf, n);
+	fsring_publish();
+	return tag;
+}
+
+// Tell the file server about the requests queued since the last call.
+// Does not wait for them.
+void
+fsring_submit(void)
+{
+	if (ring_env != thisenv->env_id || sq_rung == sq_tail)
+		return;
+	sq_rung = sq_tail;
+	ipc_send(fsenv, FSREQ_RING_ENTER, &fsring, PTE_P|PTE_U|PTE_W);
+}
+
+// Wait for a request to complete, submitting any queued ones first.
+// Stores the request's tag in *tag_store, if tag_store is not null,
+// and returns its result: the number of bytes read or written, or
+// < 0 on error.  Returns -E_INVAL if no request is in flight.
+int
+fsring_wait(int *tag_store)
+{
+	struct Fsring_cqe cqe;
+
+	if (ring_env != thisenv->env_id || nfree == FSRING_NSLOTS)
+		return -E_INVAL;
+	fsring_submit();
+	while (fsring.r_cq_tail == cq_head)
+		sys_yield();
+	barrier();
+	cqe = fsring.r_cq[cq_head++ % FSRING_NSLOTS];
+	if (cqe.cqe_slot >= FSRING_NSLOTS)
+		panic("fsring_wait: bad completion slot %u", cqe.cqe_slot);
+
+	if (slot_buf[cqe.cqe_slot] && cqe.cqe_res > 0)
+		memmove(slot_buf[cqe.cqe_slot], fsring_data(cqe.cqe_slot),
+			MIN(cqe.cqe_res, PGSIZE));
+	slot_free[nfree++] = cqe.cqe_slot;
+	if (tag_store)
+		*tag_store = cqe.cqe_slot;
+	return cqe.cqe_res;
+}
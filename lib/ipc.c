@@ -71,6 +71,43 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	}
 }
 
+// Like ipc_send, but send the 'npages' pages starting at 'pg'.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, int npages, int perm)
+{
+	int r;
+
+	while ((r = sys_ipc_try_send_pages(to_env, val, pg, npages, perm)) < 0) {
+		if (r != -E_IPC_NOT_RECV)
+			panic("send failed! %i", r);
+		sys_yield();
+	}
+}
+
+// Like ipc_recv, but accept up to *npages pages at 'pg', and store the
+// number of pages actually received in *npages.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, int *npages, int *perm_store)
+{
+	int r;
+
+	if ((r = sys_ipc_recv_pages(pg, *npages)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		*npages = 0;
+		return r;
+	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	*npages = thisenv->env_ipc_npages;
+	return (int32_t) thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
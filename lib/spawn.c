@@ -98,6 +98,9 @@ spawn(const char *prog, const char **argv)
 		return -E_NOT_EXEC;
 	}
 
+	// The child shares our fds, but not their buffers (lib/fdbuf.c)
+	fdbuf_flush_all();
+
 	// Create new child environment
 	if ((r = sys_exofork()) < 0)
 		return r;
@@ -1,6 +1,8 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
 
 #include <inc/string.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
 
 // Using assembly for memset/memmove
 // makes some difference on real hardware,
@@ -8,14 +10,119 @@
 // Primespipe runs 3x faster this way.
 #define ASM 1
 
+// User environments may also use SSE2 for large blocks (their FPU
+// state is switched lazily by kern/fpu.c); the kernel may not.  An
+// environment pays for saving its FPU state once it has used it, so
+// only blocks of at least SSE_MIN bytes take that path.
+#if ASM && !defined(JOS_KERNEL) && !defined(CONFIG_KSPACE)
+#define SSE 1
+#else
+#define SSE 0
+#endif
+#define SSE_MIN 256
+
+// Does a 32-bit word contain a zero byte?
+#define HASZERO(w) (((w) - 0x01010101U) & ~(w) & 0x80808080U)
+
+#if ASM
+// 0 = not checked yet, 1 = CPU has SSE2, -1 = it does not.
+static int sse2_state;
+
+static bool
+have_sse2(void)
+{
+	uint32_t edx;
+
+	if (!sse2_state) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sse2_state = (edx & CPUID_FEAT_SSE2) ? 1 : -1;
+	}
+	return sse2_state > 0;
+}
+#endif
+
+#if SSE
+// The SSE2 kernels are compiled for SSE2 so that their asm may clobber
+// XMM registers; the rest of the library does not assume SSE.
+
+// Copy n bytes, a multiple of 64, to 16-byte aligned d.
+static void __attribute__((target("sse2")))
+sse2_copy(char *d, const char *s, size_t n)
+{
+	if (!n)
+		return;
+	asm volatile("1:\n"
+		"movdqu 0(%1), %%xmm0\n"
+		"movdqu 16(%1), %%xmm1\n"
+		"movdqu 32(%1), %%xmm2\n"
+		"movdqu 48(%1), %%xmm3\n"
+		"movdqa %%xmm0, 0(%0)\n"
+		"movdqa %%xmm1, 16(%0)\n"
+		"movdqa %%xmm2, 32(%0)\n"
+		"movdqa %%xmm3, 48(%0)\n"
+		"addl $64, %1\n"
+		"addl $64, %0\n"
+		"subl $64, %2\n"
+		"jnz 1b\n"
+		: "+r" (d), "+r" (s), "+r" (n)
+		:
+		: "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+}
+
+// Fill n bytes, a multiple of 64, at 16-byte aligned d with word c.
+static void __attribute__((target("sse2")))
+sse2_set(char *d, uint32_t c, size_t n)
+{
+	if (!n)
+		return;
+	asm volatile("movd %2, %%xmm0\n"
+		"pshufd $0, %%xmm0, %%xmm0\n"
+		"1:\n"
+		"movdqa %%xmm0, 0(%0)\n"
+		"movdqa %%xmm0, 16(%0)\n"
+		"movdqa %%xmm0, 32(%0)\n"
+		"movdqa %%xmm0, 48(%0)\n"
+		"addl $64, %0\n"
+		"subl $64, %1\n"
+		"jnz 1b\n"
+		: "+r" (d), "+r" (n)
+		: "r" (c)
+		: "cc", "memory", "xmm0");
+}
+
+// Bit i set if byte i of the two 16-byte blocks differs.
+static uint32_t __attribute__((target("sse2")))
+sse2_cmp16(const void *a, const void *b)
+{
+	uint32_t mask;
+
+	asm("movdqu %1, %%xmm0\n"
+		"movdqu %2, %%xmm1\n"
+		"pcmpeqb %%xmm1, %%xmm0\n"
+		"pmovmskb %%xmm0, %0\n"
+		: "=r" (mask)
+		: "m" (*(const char (*)[16]) a), "m" (*(const char (*)[16]) b)
+		: "xmm0", "xmm1");
+	return mask ^ 0xFFFF;
+}
+#endif
+
+// Word at a time: an aligned word never straddles a page boundary, so
+// reading past the terminator is safe.
 int
 strlen(const char *s)
 {
-	int n;
+	const uint32_t *w;
+	const char *p;
 
-	for (n = 0; *s != '\0'; s++)
-		n++;
-	return n;
+	for (p = s; (uintptr_t) p & 3; p++)
+		if (*p == '\0')
+			return p - s;
+	for (w = (const uint32_t *) p; !HASZERO(*w); w++)
+		/* do nothing */;
+	for (p = (const char *) w; *p != '\0'; p++)
+		/* do nothing */;
+	return p - s;
 }
 
 int
@@ -79,6 +186,16 @@ strlcpy(char *dst, const char *src, size_t size)
 int
 strcmp(const char *p, const char *q)
 {
+	// Compare a word at a time while both strings are aligned alike
+	if ((((uintptr_t) p ^ (uintptr_t) q) & 3) == 0) {
+		for (; (uintptr_t) p & 3; p++, q++)
+			if (!*p || *p != *q)
+				goto bytes;
+		while (*(const uint32_t *) p == *(const uint32_t *) q &&
+		       !HASZERO(*(const uint32_t *) p))
+			p += 4, q += 4;
+	}
+bytes:
 	while (*p && *p == *q)
 		p++, q++;
 	return (int) ((unsigned char) *p - (unsigned char) *q);
@@ -121,48 +238,99 @@ strfind(const char *s, char c)
 void *
 memset(void *v, int c, size_t n)
 {
-	if (n == 0)
-		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
-		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
-		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
-	} else
+	char *p = v;
+	int d0, d1;
+
+	c &= 0xFF;
+	c = (c<<24)|(c<<16)|(c<<8)|c;
+#if SSE
+	if (n >= SSE_MIN && have_sse2()) {
+		size_t m = -(uintptr_t) p & 15;
 		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
+			: "=&D" (d0), "=&c" (d1)
+			: "0" (p), "1" (m), "a" (c)
 			: "cc", "memory");
+		p += m;
+		n -= m;
+		m = n & ~63;
+		sse2_set(p, c, m);
+		p += m;
+		n -= m;
+	}
+#endif
+	// x86 does not mind unaligned stosl
+	asm volatile("cld; rep stosl\n"
+		"movl %4, %%ecx\n"
+		"andl $3, %%ecx\n"
+		"rep stosb\n"
+		: "=&D" (d0), "=&c" (d1)
+		: "0" (p), "1" (n / 4), "g" (n), "a" (c)
+		: "cc", "memory");
 	return v;
 }
 
+// Unlike memmove(), dst and src must not overlap.
+void *
+memcpy(void *dst, const void *src, size_t n)
+{
+	const char *s = src;
+	char *d = dst;
+	int d0, d1, d2;
+
+#if SSE
+	if (n >= SSE_MIN && have_sse2()) {
+		size_t m = -(uintptr_t) d & 15;
+		asm volatile("cld; rep movsb\n"
+			: "=&D" (d0), "=&S" (d1), "=&c" (d2)
+			: "0" (d), "1" (s), "2" (m)
+			: "cc", "memory");
+		d += m;
+		s += m;
+		n -= m;
+		m = n & ~63;
+		sse2_copy(d, s, m);
+		d += m;
+		s += m;
+		n -= m;
+	}
+#endif
+	asm volatile("cld; rep movsl\n"
+		"movl %6, %%ecx\n"
+		"andl $3, %%ecx\n"
+		"rep movsb\n"
+		: "=&D" (d0), "=&S" (d1), "=&c" (d2)
+		: "0" (d), "1" (s), "2" (n / 4), "g" (n)
+		: "cc", "memory");
+	return dst;
+}
+
 void *
 memmove(void *dst, const void *src, size_t n)
 {
 	const char *s;
 	char *d;
+	int d0, d1, d2;
 
 	s = src;
 	d = dst;
-	if (s < d && s + n > d) {
-		s += n;
-		d += n;
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("std; rep movsl\n"
-				:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("std; rep movsb\n"
-				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
-		// Some versions of GCC rely on DF being clear
-		asm volatile("cld" ::: "cc");
-	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
-	}
+	if (!(s < d && s + n > d))
+		return memcpy(dst, src, n);
+
+	// Copy backwards: the odd bytes at the end, then whole words.
+	s += n;
+	d += n;
+	asm volatile("std; rep movsb\n"
+		: "=&D" (d0), "=&S" (d1), "=&c" (d2)
+		: "0" (d - 1), "1" (s - 1), "2" (n & 3)
+		: "cc", "memory");
+	s -= n & 3;
+	d -= n & 3;
+	asm volatile("std; rep movsl\n"
+		: "=&D" (d0), "=&S" (d1), "=&c" (d2)
+		: "0" (d - 4), "1" (s - 4), "2" (n / 4)
+		: "cc", "memory");
+	// Some versions of GCC rely on DF being clear
+	asm volatile("cld" ::: "cc");
 	return dst;
 }
 
@@ -201,13 +369,13 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
-#endif
 
 void *
 memcpy(void *dst, const void *src, size_t n)
 {
 	return memmove(dst, src, n);
 }
+#endif
 
 int
 memcmp(const void *v1, const void *v2, size_t n)
@@ -215,6 +383,20 @@ memcmp(const void *v1, const void *v2, size_t n)
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
 
+#if SSE
+	if (n >= SSE_MIN && have_sse2())
+		for (; n >= 16; s1 += 16, s2 += 16, n -= 16) {
+			uint32_t ne = sse2_cmp16(s1, s2);
+			if (ne) {
+				ne = bsf(ne);
+				return (int) s1[ne] - (int) s2[ne];
+			}
+		}
+#endif
+	// Skip equal words; x86 does not mind unaligned loads
+	while (n >= 4 && *(const uint32_t *) s1 == *(const uint32_t *) s2)
+		s1 += 4, s2 += 4, n -= 4;
+
 	while (n-- > 0) {
 		if (*s1 != *s2)
 			return (int) *s1 - (int) *s2;
@@ -224,6 +406,72 @@ memcmp(const void *v1, const void *v2, size_t n)
 	return 0;
 }
 
+// Whole-page zero and copy for pages the caller is not about to read
+// back (new user pages, copy-on-write copies).  MOVNTI stores bypass
+// the cache, so they do not evict the caller's working set, and they
+// need no XMM state, so the kernel can use them too.
+void
+page_zero(void *pg)
+{
+#if ASM
+	if (have_sse2()) {
+		char *p = pg;
+		int n = PGSIZE / 32;
+
+		asm volatile("1:\n"
+			"movnti %2, 0(%0)\n"
+			"movnti %2, 4(%0)\n"
+			"movnti %2, 8(%0)\n"
+			"movnti %2, 12(%0)\n"
+			"movnti %2, 16(%0)\n"
+			"movnti %2, 20(%0)\n"
+			"movnti %2, 24(%0)\n"
+			"movnti %2, 28(%0)\n"
+			"addl $32, %0\n"
+			"decl %1\n"
+			"jnz 1b\n"
+			"sfence\n"
+			: "+r" (p), "+r" (n)
+			: "r" (0)
+			: "cc", "memory");
+		return;
+	}
+#endif
+	memset(pg, 0, PGSIZE);
+}
+
+void
+page_copy(void *dst, const void *src)
+{
+#if ASM
+	if (have_sse2()) {
+		const char *s = src;
+		char *d = dst;
+		int n = PGSIZE / 16, t0, t1;
+
+		asm volatile("1:\n"
+			"movl 0(%1), %3\n"
+			"movl 4(%1), %4\n"
+			"movnti %3, 0(%0)\n"
+			"movnti %4, 4(%0)\n"
+			"movl 8(%1), %3\n"
+			"movl 12(%1), %4\n"
+			"movnti %3, 8(%0)\n"
+			"movnti %4, 12(%0)\n"
+			"addl $16, %1\n"
+			"addl $16, %0\n"
+			"decl %2\n"
+			"jnz 1b\n"
+			"sfence\n"
+			: "+r" (d), "+r" (s), "+r" (n), "=&r" (t0), "=&r" (t1)
+			:
+			: "cc", "memory");
+		return;
+	}
+#endif
+	memcpy(dst, src, PGSIZE);
+}
+
 void *
 memfind(const void *s, int c, size_t n)
 {
@@ -2,12 +2,58 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+#ifndef CONFIG_KSPACE
+// Can we enter the kernel with SYSENTER?  0 = not checked yet.
+static int sysenter_ok;
+
+static inline bool
+use_sysenter(void)
+{
+	uint32_t edx;
+
+	if (!sysenter_ok) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		sysenter_ok = (edx & CPUID_FEAT_SEP) ? 1 : -1;
+	}
+	return sysenter_ok > 0;
+}
+#endif
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
 
+#ifndef CONFIG_KSPACE
+	// Fast system call, taken when there is no fifth argument.
+	// SYSENTER saves neither the return address nor the stack, so
+	// pass them in SI and BP; the kernel returns with SYSEXIT,
+	// which clobbers DX and CX.  The kernel does the same check on
+	// CPUID, so it has set up the entry point whenever we get here.
+	if (a5 == 0 && use_sysenter()) {
+		asm volatile("pushl %%ebp\n"
+			"movl %%esp, %%ebp\n"
+			"leal 1f, %%esi\n"
+			"sysenter\n"
+			"1: popl %%ebp\n"
+			: "=a" (ret),
+			  "+d" (a1),
+			  "+c" (a2),
+			  "=S" (a5)
+			: "a" (num),
+			  "b" (a3),
+			  "D" (a4)
+			: "cc", "memory");
+
+		if(check && ret > 0)
+			panic("syscall %d returned %d (> 0)", num, ret);
+
+		return ret;
+	}
+#endif
+
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
 	// Interrupt kernel with T_SYSCALL.
@@ -105,18 +151,54 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_cpumask(envid_t envid, uint32_t mask)
+{
+	return syscall(SYS_env_set_cpumask, 1, envid, mask, 0, 0, 0);
+}
+
+int
+sys_irq_listen(int irq)
+{
+	return syscall(SYS_irq_listen, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(int irq)
+{
+	return syscall(SYS_irq_wait, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_region_share(envid_t envid, void *va, size_t size)
+{
+	return syscall(SYS_region_share, 1, envid, (uint32_t) va, size, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, int npages, int perm)
+{
+	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, npages);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_pages(void *dstva, int npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, 0, 0, 0);
+}
+
 int
 sys_gettime(void)
 {
@@ -1,5 +1,6 @@
 #include <inc/vsyscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 static inline int32_t
 vsyscall(int num)
@@ -11,4 +12,52 @@ vsyscall(int num)
 int vsys_gettime(void)
 {
 	return vsyscall(VSYS_gettime);
-}
\ No newline at end of file
+}
+
+// clock_gettime() without entering the kernel for CLOCK_MONOTONIC
+// and CLOCK_REALTIME: read the TSC and convert it with the parameters
+// the kernel publishes in the vsys page.  Other clocks, and any clock
+// before the kernel has published them, go through the system call.
+int vsys_clock_gettime(int clock_id, struct timespec *tp)
+{
+	uint32_t gen, mult, shift;
+	uint64_t start, tme;
+	struct timespec rt;
+	int64_t ns;
+
+	if (clock_id != CLOCK_MONOTONIC && clock_id != CLOCK_REALTIME)
+		return sys_clock_gettime(clock_id, tp);
+
+	do {
+		while ((gen = vsyscall(VSYS_clock_gen)) & 1)
+			asm volatile("pause");
+		mult = vsyscall(VSYS_tsc_mult);
+		shift = vsyscall(VSYS_tsc_shift);
+		start = (uint32_t) vsyscall(VSYS_mono_start_lo) |
+			(uint64_t) vsyscall(VSYS_mono_start_hi) << 32;
+		rt.tv_sec = vsyscall(VSYS_realtime_sec);
+		rt.tv_nsec = vsyscall(VSYS_realtime_nsec);
+		tme = read_tsc() - start;
+	} while (vsyscall(VSYS_clock_gen) != gen);
+
+	if (!gen)
+		return sys_clock_gettime(clock_id, tp);
+
+	ns = mul_u64_u32_shr(tme, mult, shift);
+	if (clock_id == CLOCK_REALTIME)
+		ns += timespec_to_ns(&rt);
+	*tp = ns_to_timespec(ns);
+	return 0;
+}
+
+// Milliseconds of CLOCK_MONOTONIC since *start, which the caller read
+// with vsys_clock_gettime.  For benchmarks.
+int
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &now);
+	now = sub_timespec(&now, start);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
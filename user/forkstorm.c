@@ -0,0 +1,45 @@
+// Fork-storm benchmark: fork children that each dirty a set of
+// copy-on-write pages and exit, and report forks and COW faults per
+// second.  Exercises page_alloc(ALLOC_ZERO) in the kernel and
+// page_copy() in the fork page fault handler.
+
+#include <inc/lib.h>
+
+#define NFORK	64
+#define NPAGE	32
+#define NBATCH	8
+
+static char data[NPAGE * PGSIZE] __attribute__((aligned(PGSIZE)));
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NBATCH];
+	struct timespec start;
+	int i, j, k, ms;
+
+	// Map every page before forking, so the children fault on COW
+	for (i = 0; i < NPAGE; i++)
+		data[i * PGSIZE] = i;
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NFORK; i += NBATCH) {
+		for (j = 0; j < NBATCH; j++) {
+			if ((kids[j] = fork()) < 0)
+				panic("fork: %i", kids[j]);
+			if (kids[j] == 0) {
+				for (k = 0; k < NPAGE; k++)
+					data[k * PGSIZE + 1] = k;
+				exit();
+			}
+		}
+		for (j = 0; j < NBATCH; j++)
+			wait(kids[j]);
+	}
+	if ((ms = elapsed_ms(&start)) == 0)
+		ms = 1;
+	cprintf("forkstorm: %d forks, %d COW faults in %d ms\n",
+		NFORK, NFORK * NPAGE, ms);
+	cprintf("forkstorm: %d forks/sec, %d faults/sec\n",
+		NFORK * 1000 / ms, NFORK * NPAGE * 1000 / ms);
+}
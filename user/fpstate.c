@@ -0,0 +1,45 @@
+// Check that x87 and SSE registers survive context switches: several
+// environments keep different values in the FPU while yielding.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NYIELD	200
+
+static void
+check(int id)
+{
+	double x = id + 0.5, y;
+	uint32_t in = 0x1234 * (id + 1), out;
+	int i;
+
+	asm volatile("movd %0, %%xmm1" : : "r" (in));
+	for (i = 0; i < NYIELD; i++) {
+		// Keep x in st(0) across the yield
+		asm volatile("fldl %0" : : "m" (x));
+		sys_yield();
+		asm volatile("fstpl %0" : "=m" (y));
+		if (y != x)
+			panic("env %d: x87 state lost", id);
+		asm volatile("movd %%xmm1, %0" : "=r" (out));
+		if (out != in)
+			panic("env %d: xmm1 %x, expected %x", id, out, in);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+	envid_t who;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %i", who);
+		if (who == 0) {
+			check(i);
+			cprintf("fpstate: env %d OK\n", i);
+			return;
+		}
+	}
+}
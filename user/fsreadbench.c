@@ -0,0 +1,94 @@
+// File read throughput benchmark.
+// Reads every file in the root directory, like `cat` would, in
+// SMALLBUF pieces.  The first pass comes from the disk, so it measures
+// how well the file server clusters and reads ahead; the second is
+// served from the block cache.  The third reads in LARGEBUF pieces,
+// which go to the server as vectored requests.  The last two passes
+// run with the server's block cache limited to SMALLCACHE blocks, far
+// less than the files hold, so the second of them has to evict and
+// read most blocks again; the cache counters show how many.  Run with
+// `make run-fsreadbench`.
+
+#include <inc/lib.h>
+
+#define SMALLBUF	4096
+#define LARGEBUF	(FSIPC_MAXPAGES * PGSIZE)
+#define SMALLCACHE	64
+
+static char buf[LARGEBUF];
+
+// Read all of path, returning the number of bytes read.
+static uint32_t
+catfile(const char *path, size_t bufsize)
+{
+	uint32_t total = 0;
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %i", path, fd);
+	while ((n = read(fd, buf, bufsize)) > 0)
+		total += n;
+	if (n < 0)
+		panic("read %s: %i", path, n);
+	close(fd);
+	return total;
+}
+
+static void
+pass(const char *name, size_t bufsize)
+{
+	struct Fscachestat before, after;
+	struct timespec start;
+	struct File f;
+	uint32_t bytes = 0;
+	int dir, n, nfiles = 0, r, ms;
+
+	if ((r = fscachestat(0, &before)) < 0)
+		panic("fscachestat: %i", r);
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((dir = open("/", O_RDONLY)) < 0)
+		panic("open /: %i", dir);
+	while ((n = readn(dir, &f, sizeof f)) == sizeof f)
+		if (f.f_name[0] && f.f_type == FTYPE_REG) {
+			bytes += catfile(f.f_name, bufsize);
+			nfiles++;
+		}
+	if (n < 0)
+		panic("read /: %i", n);
+	close(dir);
+	if ((ms = elapsed_ms(&start)) == 0)
+		ms = 1;
+	if ((r = fscachestat(0, &after)) < 0)
+		panic("fscachestat: %i", r);
+
+	cprintf("fsreadbench: %s: %d files, %u KB in %d ms, %u KB/s\n",
+		name, nfiles, bytes / 1024, ms, bytes / ms * 1000 / 1024);
+	cprintf("fsreadbench: %s: %u hits, %u misses, %u blocks read, "
+		"%u evicted (%u dirty), %u/%u cached\n",
+		name, after.cs_hits - before.cs_hits,
+		after.cs_misses - before.cs_misses,
+		after.cs_reads - before.cs_reads,
+		after.cs_evictions - before.cs_evictions,
+		after.cs_dirty_evictions - before.cs_dirty_evictions,
+		after.cs_nblocks, after.cs_limit);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Fscachestat st;
+	uint32_t limit;
+	int r;
+
+	pass("cold", SMALLBUF);
+	pass("warm", SMALLBUF);
+	pass("warm, large reads", LARGEBUF);
+
+	if ((r = fscachestat(0, &st)) < 0)
+		panic("fscachestat: %i", r);
+	limit = st.cs_limit;
+	fscachestat(SMALLCACHE, &st);
+	pass("small cache", SMALLBUF);
+	pass("small cache, again", SMALLBUF);
+	fscachestat(limit, &st);
+}
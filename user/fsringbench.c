@@ -0,0 +1,155 @@
+// Asynchronous I/O queue-depth benchmark.
+// Reads the largest file in the root directory a page at a time
+// through the file server's I/O ring, keeping 1, 2, 4, ... up to
+// FSRING_NSLOTS reads in flight, and compares with plain read calls.
+// The file is read once beforehand so that every pass comes from the
+// block cache and measures the request path, not the disk.  Also
+// checks that ring writes and reads agree with ordinary ones.  Run
+// with `make run-fsringbench`.
+
+#include <inc/lib.h>
+
+#define TESTFILE	"/fsringbench.tmp"
+#define TESTPAGES	8
+
+static char buf[FSRING_NSLOTS][PGSIZE];
+
+// Find the largest regular file in the root directory.
+static void
+largest_file(char *name, off_t *size)
+{
+	struct File f;
+	int dir, n;
+
+	*size = 0;
+	if ((dir = open("/", O_RDONLY)) < 0)
+		panic("open /: %i", dir);
+	while ((n = readn(dir, &f, sizeof f)) == sizeof f)
+		if (f.f_name[0] && f.f_type == FTYPE_REG && f.f_size > *size) {
+			strcpy(name, f.f_name);
+			*size = f.f_size;
+		}
+	if (n < 0)
+		panic("read /: %i", n);
+	close(dir);
+}
+
+static void
+report(const char *name, uint32_t bytes, struct timespec *start)
+{
+	int ms;
+
+	if ((ms = elapsed_ms(start)) == 0)
+		ms = 1;
+	cprintf("fsringbench: %s: %u KB in %d ms, %u KB/s\n",
+		name, bytes / 1024, ms, bytes / ms * 1000 / 1024);
+}
+
+// Read all of fd with read calls.
+static void
+sync_pass(int fd)
+{
+	struct timespec start;
+	uint32_t bytes = 0;
+	int n;
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	seek(fd, 0);
+	while ((n = read(fd, buf[0], PGSIZE)) > 0)
+		bytes += n;
+	if (n < 0)
+		panic("read: %i", n);
+	report("read", bytes, &start);
+}
+
+// Read fd's size bytes through the ring, depth reads at a time.
+static void
+ring_pass(int fd, off_t size, int depth)
+{
+	struct timespec start;
+	uint32_t bytes = 0;
+	off_t next = 0;
+	int inflight = 0, r;
+	char name[32];
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	while (next < size || inflight > 0) {
+		for (; inflight < depth && next < size; inflight++, next += PGSIZE)
+			if ((r = fsring_read(fd, buf[next / PGSIZE % FSRING_NSLOTS],
+					     PGSIZE, next)) < 0)
+				panic("fsring_read: %i", r);
+		if ((r = fsring_wait(NULL)) < 0)
+			panic("fsring_wait: %i", r);
+		bytes += r;
+		inflight--;
+	}
+	snprintf(name, sizeof name, "ring, depth %d", depth);
+	report(name, bytes, &start);
+}
+
+// Write TESTPAGES pages through the ring, all in flight at once, and
+// check them with read; then the other way around.
+static void
+check(void)
+{
+	static char page[PGSIZE];
+	int fd, i, j, r;
+
+	if ((fd = open(TESTFILE, O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open %s: %i", TESTFILE, fd);
+
+	for (i = 0; i < TESTPAGES; i++) {
+		memset(page, 'a' + i, PGSIZE);
+		if ((r = fsring_write(fd, page, PGSIZE, i * PGSIZE)) < 0)
+			panic("fsring_write: %i", r);
+	}
+	for (i = 0; i < TESTPAGES; i++)
+		if ((r = fsring_wait(NULL)) != PGSIZE)
+			panic("fsring_wait after write: %i", r);
+	for (i = 0; i < TESTPAGES; i++) {
+		if ((r = readn(fd, page, PGSIZE)) != PGSIZE)
+			panic("readn: %i", r);
+		for (j = 0; j < PGSIZE; j++)
+			if (page[j] != 'a' + i)
+				panic("page %d byte %d is %02x", i, j, page[j]);
+	}
+
+	for (i = TESTPAGES - 1; i >= 0; i--)
+		if ((r = fsring_read(fd, buf[i], PGSIZE, i * PGSIZE)) < 0)
+			panic("fsring_read: %i", r);
+	for (i = 0; i < TESTPAGES; i++)
+		if ((r = fsring_wait(NULL)) != PGSIZE)
+			panic("fsring_wait after read: %i", r);
+	for (i = 0; i < TESTPAGES; i++)
+		for (j = 0; j < PGSIZE; j++)
+			if (buf[i][j] != 'a' + i)
+				panic("ring read page %d byte %d is %02x",
+				      i, j, buf[i][j]);
+
+	close(fd);
+	remove(TESTFILE);
+	cprintf("fsringbench: ring writes and reads check out\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	char name[MAXNAMELEN];
+	off_t size;
+	int fd, depth;
+
+	check();
+
+	largest_file(name, &size);
+	if (size == 0)
+		panic("no files to read");
+	if ((fd = open(name, O_RDONLY)) < 0)
+		panic("open %s: %i", name, fd);
+	cprintf("fsringbench: reading %s, %d KB\n", name, size / 1024);
+
+	sync_pass(fd);
+	sync_pass(fd);
+	for (depth = 1; depth <= FSRING_NSLOTS; depth *= 2)
+		ring_pass(fd, size, depth);
+	close(fd);
+}
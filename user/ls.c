@@ -25,7 +25,7 @@ lsdir(const char *path, const char *prefix)
 	int fd, n;
 	struct File f;
 
-	if ((fd = open(path, O_RDONLY)) < 0)
+	if ((fd = open(path, O_RDONLY | O_BUFFERED)) < 0)
 		panic("open %s: %i", path, fd);
 	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
 		if (f.f_name[0])
@@ -0,0 +1,71 @@
+// Open/close rate benchmark.
+// Children each hold a batch of files open, so that the file server's
+// open-file table is well filled, and then the parent opens and closes
+// a file in a loop.  Run with `make run-openbench`.
+
+#include <inc/lib.h>
+
+#define NCHILD	16
+#define NHELD	30
+#define NOPEN	5000
+
+static void
+child(envid_t parent)
+{
+	int i, r;
+
+	for (i = 0; i < NHELD; i++)
+		if ((r = open("/motd", O_RDONLY)) < 0)
+			panic("open /motd: %i", r);
+	ipc_send(parent, 0, NULL, 0);
+
+	// Hold them until the parent is done
+	ipc_recv(NULL, NULL, NULL);
+}
+
+static void
+pass(const char *name, const char *path, int mode)
+{
+	struct timespec start;
+	int i, fd, ms;
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NOPEN; i++) {
+		if ((fd = open(path, mode)) < 0)
+			panic("open %s: %i", path, fd);
+		close(fd);
+	}
+	if ((ms = elapsed_ms(&start)) == 0)
+		ms = 1;
+
+	cprintf("openbench: %s: %d opens in %d ms, %d/sec\n",
+		name, NOPEN, ms, NOPEN * 1000 / ms);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid(), kids[NCHILD];
+	int i;
+
+	pass("idle table", "/motd", O_RDONLY);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0) {
+			child(parent);
+			return;
+		}
+	}
+	for (i = 0; i < NCHILD; i++)
+		ipc_recv(NULL, NULL, NULL);
+
+	cprintf("openbench: %d files held open\n", NCHILD * NHELD);
+	pass("full table", "/motd", O_RDONLY);
+	pass("create", "/openbench", O_RDWR | O_CREAT);
+	remove("/openbench");
+
+	for (i = 0; i < NCHILD; i++)
+		ipc_send(kids[i], 0, NULL, 0);
+}
@@ -0,0 +1,72 @@
+// Scheduler scalability benchmark, built on stresssched.
+// Forks a batch of yield-bound children and reports context switches
+// per second for every CPU.  Run with e.g. `make CPUS=4 run-schedbench`.
+
+#include <inc/lib.h>
+
+#define NCHILD	16
+#define NYIELD	2000
+#define MAXCPU	8
+
+static void
+child(envid_t parent)
+{
+	uint32_t counts[MAXCPU] = { 0 };
+	int i;
+
+	// Wait for the parent to finish forking
+	ipc_recv(NULL, NULL, NULL);
+
+	for (i = 0; i < NYIELD; i++) {
+		sys_yield();
+		counts[thisenv->env_cpunum % MAXCPU]++;
+	}
+
+	// Report as (cpu << 28) | count
+	for (i = 0; i < MAXCPU; i++)
+		if (counts[i])
+			ipc_send(parent, (i << 28) | counts[i], NULL, 0);
+	ipc_send(parent, ~0U, NULL, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid(), kids[NCHILD];
+	uint32_t counts[MAXCPU] = { 0 }, total = 0, v;
+	struct timespec start;
+	int i, done, ms;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0) {
+			child(parent);
+			return;
+		}
+	}
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NCHILD; i++)
+		ipc_send(kids[i], 0, NULL, 0);
+
+	for (done = 0; done < NCHILD; ) {
+		v = ipc_recv(NULL, NULL, NULL);
+		if (v == ~0U) {
+			done++;
+			continue;
+		}
+		counts[v >> 28] += v & ((1 << 28) - 1);
+		total += v & ((1 << 28) - 1);
+	}
+	if ((ms = elapsed_ms(&start)) == 0)
+		ms = 1;
+
+	cprintf("schedbench: %d envs, %u switches in %d ms\n",
+		NCHILD, total, ms);
+	for (i = 0; i < MAXCPU; i++)
+		if (counts[i])
+			cprintf("schedbench: CPU %d: %u switches, %u/sec\n",
+				i, counts[i], counts[i] * 1000 / ms);
+	cprintf("schedbench: total %u switches/sec\n", total * 1000 / ms);
+}
@@ -0,0 +1,51 @@
+// Small-I/O benchmark for buffered file descriptors.
+// Writes a file as many short fprintf() lines and reads it back a
+// struct File at a time, like ls does, once with plain descriptors and
+// once with O_BUFFERED ones.  Each unbuffered call is a file server
+// request; buffered ones share a request per page.  Run with
+// `make run-smalliobench`.
+
+#include <inc/lib.h>
+
+#define NLINES	2000
+#define RECSIZE	256
+
+static void
+pass(const char *name, int flags)
+{
+	struct timespec start;
+	char rec[RECSIZE];
+	int fd, i, n, wms, rms;
+	uint32_t bytes = 0;
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((fd = open("/smallio", O_WRONLY | O_CREAT | O_TRUNC | flags)) < 0)
+		panic("open /smallio: %i", fd);
+	for (i = 0; i < NLINES; i++)
+		if ((n = fprintf(fd, "line %d\n", i)) < 0)
+			panic("fprintf: %i", n);
+	if ((n = close(fd)) < 0)
+		panic("close: %i", n);
+	wms = elapsed_ms(&start);
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((fd = open("/smallio", O_RDONLY | flags)) < 0)
+		panic("open /smallio: %i", fd);
+	while ((n = readn(fd, rec, sizeof rec)) > 0)
+		bytes += n;
+	if (n < 0)
+		panic("readn: %i", n);
+	close(fd);
+	rms = elapsed_ms(&start);
+
+	cprintf("smalliobench: %s: %d writes in %d ms, %u bytes read in %d ms\n",
+		name, NLINES, wms, bytes, rms);
+}
+
+void
+umain(int argc, char **argv)
+{
+	pass("unbuffered", 0);
+	pass("buffered", O_BUFFERED);
+	remove("/smallio");
+}
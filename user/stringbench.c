@@ -0,0 +1,145 @@
+// Check lib/string.c against byte-at-a-time references over a range
+// of sizes and alignments, then report cycles per KB for each routine.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define BUFSZ	(PGSIZE * 4)
+#define NITER	200
+
+static char buf1[BUFSZ + 64] __attribute__((aligned(64)));
+static char buf2[BUFSZ + 64] __attribute__((aligned(64)));
+static char ref[BUFSZ + 64] __attribute__((aligned(64)));
+
+static int
+sign(int x)
+{
+	return x < 0 ? -1 : x > 0;
+}
+
+static void
+fill(char *p, size_t n, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		p[i] = (char) (i * 7 + seed) | 1;
+}
+
+static void
+check(void)
+{
+	static const size_t sizes[] = { 0, 1, 3, 4, 15, 16, 63, 64, 255,
+					256, 257, 1000, 4096, 5000 };
+	size_t i, k, n;
+	int so, doff;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		for (so = 0; so < 16; so += 3)
+			for (doff = 0; doff < 16; doff += 5) {
+				n = sizes[i];
+
+				fill(buf1, BUFSZ, so);
+				memset(buf2, 0, BUFSZ);
+				memset(ref, 0, BUFSZ);
+				memcpy(buf2 + doff, buf1 + so, n);
+				for (k = 0; k < n; k++)
+					ref[doff + k] = buf1[so + k];
+				if (memcmp(buf2, ref, BUFSZ) != 0)
+					panic("memcpy %d bytes, offsets %d/%d", n, so, doff);
+
+				memset(buf2 + doff, 0x5a, n);
+				for (k = 0; k < n; k++)
+					ref[doff + k] = 0x5a;
+				if (memcmp(buf2, ref, BUFSZ) != 0)
+					panic("memset %d bytes, offset %d", n, doff);
+
+				// Overlapping moves in both directions
+				fill(buf2, BUFSZ, 1);
+				fill(ref, BUFSZ, 1);
+				memmove(buf2 + doff + so, buf2 + doff, n);
+				for (k = n; k-- > 0; )
+					ref[doff + so + k] = ref[doff + k];
+				memmove(buf2 + doff, buf2 + doff + so, n);
+				for (k = 0; k < n; k++)
+					ref[doff + k] = ref[doff + so + k];
+				if (memcmp(buf2, ref, BUFSZ) != 0)
+					panic("memmove %d bytes, shift %d", n, so);
+
+				// fill() bytes are odd, so never 0x00 or 0xfe
+				if (n) {
+					memcpy(ref + doff, buf2 + so, n);
+					ref[doff + n - 1]--;
+					if (sign(memcmp(buf2 + so, ref + doff, n)) != 1)
+						panic("memcmp %d bytes", n);
+					ref[doff + n - 1] = buf2[so + n - 1] + 1;
+					if ((uint8_t) buf2[so + n - 1] != 0xff &&
+					    sign(memcmp(buf2 + so, ref + doff, n)) != -1)
+						panic("memcmp %d bytes", n);
+				}
+
+				fill(buf1, BUFSZ, so);
+				buf1[so + n] = '\0';
+				if (strlen(buf1 + so) != n)
+					panic("strlen %d, offset %d", n, so);
+				fill(buf2, BUFSZ, so);
+				buf2[doff + n] = '\0';
+				memmove(buf2 + doff, buf1 + so, n + 1);
+				if (strcmp(buf1 + so, buf2 + doff) != 0)
+					panic("strcmp %d bytes", n);
+			}
+}
+
+static void
+report(const char *name, uint64_t cycles, size_t n)
+{
+	cprintf("stringbench: %-8s %8llu cycles/KB\n",
+		name, cycles * 1024 / ((uint64_t) n * NITER));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	int i;
+
+	check();
+	cprintf("stringbench: all checks passed\n");
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		memcpy(buf1, buf2 + 1, BUFSZ);
+	report("memcpy", read_tsc() - start, BUFSZ);
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		memmove(buf1 + 1, buf1, BUFSZ);
+	report("memmove", read_tsc() - start, BUFSZ);
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		memset(buf1 + 3, i, BUFSZ);
+	report("memset", read_tsc() - start, BUFSZ);
+
+	memcpy(buf2, buf1, BUFSZ);
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		if (memcmp(buf1, buf2, BUFSZ) != 0)
+			panic("memcmp");
+	report("memcmp", read_tsc() - start, BUFSZ);
+
+	fill(buf1, BUFSZ, 0);
+	buf1[BUFSZ - 1] = '\0';
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		if (strlen(buf1) != BUFSZ - 1)
+			panic("strlen");
+	report("strlen", read_tsc() - start, BUFSZ);
+
+	memcpy(buf2, buf1, BUFSZ);
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		if (strcmp(buf1, buf2) != 0)
+			panic("strcmp");
+	report("strcmp", read_tsc() - start, BUFSZ);
+}
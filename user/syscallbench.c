@@ -0,0 +1,61 @@
+// System call throughput benchmark.
+// Each child maps and unmaps a page in its own address space, which
+// touches only its own env lock and the page allocator, so the total
+// rate should grow with the number of CPUs.  Compare
+// `make CPUS=1 run-syscallbench` with CPUS=2 and CPUS=4.
+
+#include <inc/lib.h>
+
+#define NCHILD	8
+#define NCALL	20000
+
+static void
+child(envid_t parent)
+{
+	char *va = (char *) 0x10000000;
+	int i, r;
+
+	// Wait for the parent to finish forking
+	ipc_recv(NULL, NULL, NULL);
+
+	for (i = 0; i < NCALL; i += 2) {
+		if ((r = sys_page_alloc(0, va, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %i", r);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("sys_page_unmap: %i", r);
+	}
+	ipc_send(parent, thisenv->env_cpunum, NULL, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid(), kids[NCHILD];
+	struct timespec start;
+	uint32_t cpus = 0;
+	int i, ms, ncpus = 0;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %i", kids[i]);
+		if (kids[i] == 0) {
+			child(parent);
+			return;
+		}
+	}
+
+	vsys_clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NCHILD; i++)
+		ipc_send(kids[i], 0, NULL, 0);
+	for (i = 0; i < NCHILD; i++)
+		cpus |= 1 << ipc_recv(NULL, NULL, NULL);
+	if ((ms = elapsed_ms(&start)) == 0)
+		ms = 1;
+	for (i = 0; i < 32; i++)
+		if (cpus & (1 << i))
+			ncpus++;
+
+	cprintf("syscallbench: %d envs on %d CPU(s), %d syscalls in %d ms\n",
+		NCHILD, ncpus, NCHILD * NCALL, ms);
+	cprintf("syscallbench: %d syscalls/sec\n", NCHILD * NCALL / ms * 1000);
+}
@@ -0,0 +1,89 @@
+// Round-trip cost of trivial system calls through the SYSENTER fast
+// path (what lib/syscall.c uses when the CPU supports it) and through
+// the int $T_SYSCALL trap gate, and of reading the clock through the
+// vsys page instead of sys_clock_gettime().
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALL	100000
+
+static const char *clock_names[CLOCK_NUM] = {
+	[CLOCK_MONOTONIC] = "MONOTONIC",
+	[CLOCK_REALTIME] = "REALTIME",
+	[CLOCK_PROCESS_CPUTIME_ID] = "CPUTIME",
+};
+
+static int32_t
+int_syscall(int num)
+{
+	int32_t ret;
+
+	asm volatile("int %1\n"
+		: "=a" (ret)
+		: "i" (T_SYSCALL),
+		  "a" (num),
+		  "d" (0),
+		  "c" (0),
+		  "b" (0),
+		  "D" (0),
+		  "S" (0)
+		: "cc", "memory");
+	return ret;
+}
+
+static void
+report(const char *name, uint64_t fast, uint64_t slow)
+{
+	cprintf("syscallcost: %-8s lib %6llu cycles, int %6llu cycles\n",
+		name, fast / NCALL, slow / NCALL);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct timespec tp;
+	uint64_t start, fast, slow;
+	int i, id;
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		sys_getenvid();
+	fast = read_tsc() - start;
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		int_syscall(SYS_getenvid);
+	slow = read_tsc() - start;
+	report("getenvid", fast, slow);
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		sys_yield();
+	fast = read_tsc() - start;
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		int_syscall(SYS_yield);
+	slow = read_tsc() - start;
+	report("yield", fast, slow);
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		vsys_clock_gettime(CLOCK_MONOTONIC, &tp);
+	fast = read_tsc() - start;
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		sys_clock_gettime(CLOCK_MONOTONIC, &tp);
+	slow = read_tsc() - start;
+	cprintf("syscallcost: %-8s vsys %6llu cycles, sys %6llu cycles\n",
+		"clock", fast / NCALL, slow / NCALL);
+
+	// The kernel's own conversion, per clock id
+	for (id = 0; id < CLOCK_NUM; id++) {
+		start = read_tsc();
+		for (i = 0; i < NCALL; i++)
+			sys_clock_gettime(id, &tp);
+		slow = read_tsc() - start;
+		cprintf("syscallcost: sys_clock_gettime(%s) %llu cycles\n",
+			clock_names[id], slow / NCALL);
+	}
+}
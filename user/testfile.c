@@ -4,6 +4,11 @@ const char *msg = "This is the NEW message of the day!\n\n";
 
 #define FVA ((struct Fd*)0xCCCCC000)
 
+// Blocks the sparse file test writes: one in the extents, one behind
+// the indirect block, one behind the double-indirect block
+static const int sparse[] = { 0, NEXTENT*3 + 5, NINDIRECT + 3 };
+#define NSPARSE	(sizeof(sparse) / sizeof(sparse[0]))
+
 static int
 xopen(const char *path, int mode)
 {
@@ -18,6 +23,22 @@ xopen(const char *path, int mode)
 	return ipc_recv(NULL, FVA, NULL);
 }
 
+// Check that the first 512 bytes of file block blockno in f are all c.
+static void
+check_block(int f, int blockno, char c)
+{
+	char buf[512];
+	int r, i;
+
+	seek(f, blockno * BLKSIZE);
+	if ((r = readn(f, buf, sizeof(buf))) != sizeof(buf))
+		panic("read /sparse block %d: %i", blockno, r);
+	for (i = 0; i < sizeof(buf); i++)
+		if (buf[i] != c)
+			panic("read /sparse block %d byte %d: %02x, wanted %02x",
+			      blockno, i, buf[i], c);
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -98,11 +119,11 @@ umain(int argc, char **argv)
 		panic("open did not fill struct Fd correctly\n");
 	cprintf("open is good\n");
 
-	// Try files with indirect blocks
+	// Try a file larger than a few blocks
 	if ((f = open("/big", O_WRONLY|O_CREAT)) < 0)
 		panic("creat /big: %i", f);
 	memset(buf, 0, sizeof(buf));
-	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += sizeof(buf)) {
+	for (i = 0; i < (NEXTENT*3)*BLKSIZE; i += sizeof(buf)) {
 		*(int*)buf = i;
 		if ((r = write(f, buf, sizeof(buf))) < 0)
 			panic("write /big@%d: %i", i, r);
@@ -111,7 +132,7 @@ umain(int argc, char **argv)
 
 	if ((f = open("/big", O_RDONLY)) < 0)
 		panic("open /big: %i", f);
-	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += sizeof(buf)) {
+	for (i = 0; i < (NEXTENT*3)*BLKSIZE; i += sizeof(buf)) {
 		*(int*)buf = i;
 		if ((r = readn(f, buf, sizeof(buf))) < 0)
 			panic("read /big@%d: %i", i, r);
@@ -124,5 +145,40 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
+
+	// Try a sparse file that reaches the pointer blocks, then
+	// truncate it back into its extents
+	if ((f = open("/sparse", O_RDWR|O_CREAT)) < 0)
+		panic("creat /sparse: %i", f);
+	for (i = 0; i < NSPARSE; i++) {
+		memset(buf, 'a' + i, sizeof(buf));
+		seek(f, sparse[i] * BLKSIZE);
+		if ((r = write(f, buf, sizeof(buf))) != sizeof(buf))
+			panic("write /sparse block %d: %i", sparse[i], r);
+	}
+	if ((r = fstat(f, &st)) < 0)
+		panic("fstat /sparse: %i", r);
+	if (st.st_size != sparse[NSPARSE - 1] * BLKSIZE + sizeof(buf))
+		panic("/sparse has size %d", st.st_size);
+	for (i = 0; i < NSPARSE; i++) {
+		check_block(f, sparse[i], 'a' + i);
+		// Holes read as zeros
+		check_block(f, i == 0 ? 1 : sparse[i] - 1, 0);
+	}
+
+	// Back to one block, which frees the pointer blocks
+	if ((r = ftruncate(f, BLKSIZE)) < 0)
+		panic("ftruncate /sparse: %i", r);
+	check_block(f, 0, 'a');
+	// The extents take new blocks again
+	memset(buf, 'z', sizeof(buf));
+	seek(f, BLKSIZE);
+	if ((r = write(f, buf, sizeof(buf))) != sizeof(buf))
+		panic("write /sparse block 1: %i", r);
+	check_block(f, 1, 'z');
+	close(f);
+	if ((r = remove("/sparse")) < 0)
+		panic("remove /sparse: %i", r);
+	cprintf("sparse file is good\n");
 }
 